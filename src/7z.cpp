@@ -1,325 +1,429 @@
 #include "7z.h"
+#include "glob.h"
 #include "method.h"
+#include "output.h"
+#include "parallel.h"
+#include "ring_buffer.h"
+#include "uring.h"
 
 #include "fmt/core.h"
 #include "fmt/os.h"
 #include "fmt/format.h"
-#include "fmt/xchar.h"
 
 #include "mimalloc-new-delete.h"
 
-#ifdef _WIN32
-#include <windows.h>
-#endif
-
 namespace I7Zip {
 
 constexpr static uint8_t MAGIC_AND_VERSION[8] = {'7', 'z', 0xbc, 0xaf, 0x27, 0x1c, 0x0, 0x4};
 constexpr static uint32_t SIGNATURE_HEADER_SIZE = 32;
 
-static bool is_valid(uint8_t *buf)
+static bool is_valid(const uint8_t *buf)
 {
     return ::memcmp(buf, MAGIC_AND_VERSION, 8) == 0;
 }
 
-static std::string utf16_to_utf8(wchar_t *in)
+static bool write_file(const FileInfo &info, const uint8_t *buffer, uint32_t crc)
 {
-    int size = WideCharToMultiByte(CP_UTF8, 0, in, -1, NULL, 0, NULL, NULL);
-    std::string out(size, 0);
-    WideCharToMultiByte(CP_UTF8, 0, in, -1, &out[0], size, NULL, NULL);
-    out.pop_back(); // remove trailling '\0'
-    return out;
-}
+    if (info.crc() != crc) {
+        fmt::print("incorrect crc32\n");
+        return false;
+    }
 
-static bool ensure_dir_exists(const wchar_t *name)
-{
-    const wchar_t *p = name;
-    wchar_t tmp[MAX_PATH];
-    uint32_t i = 0;
+    print_extracted(info);
 
-    while (*p != L'\0') {
-        if (*p != L'/') {
-            tmp[i++] = *p;
-        } else {
-            tmp[i] = L'\0';
-            if (CreateDirectoryW(tmp, nullptr) == FALSE) {
-                DWORD err = GetLastError();
-                if (err != ERROR_ALREADY_EXISTS) {
-                    fmt::print("CreateDirectoryW() failed {}\n", err);
+    OutputFile f;
+    return f.open(info) && f.write(buffer, info.size());
+}
+
+// Computes the crc32 of every substream while the folder is decoded, so each
+// byte is hashed right after the decoder wrote it instead of in a second
+// pass over the whole folder buffer
+class SubstreamCrc {
+public:
+    SubstreamCrc(const std::vector<uint32_t> &sizes)
+        : _sizes(sizes), _crcs(sizes.size(), 0), _index(0), _remaining(sizes.empty() ? 0 : sizes[0]) {}
+
+    bool update(const uint8_t *data, size_t size)
+    {
+        while (size) {
+            while (_remaining == 0) {
+                if (++_index >= _sizes.size()) {
+                    fmt::print("folder has more data than its substreams\n");
                     return false;
                 }
+                _remaining = _sizes[_index];
             }
-            tmp[i++] = L'/';
+
+            size_t n = size < _remaining ? size : (size_t)_remaining;
+            _crcs[_index] = crc32_update(_crcs[_index], data, n);
+            data += n;
+            size -= n;
+            _remaining -= n;
         }
-        ++p;
+        return true;
     }
 
-    return true;
-}
+    std::vector<uint32_t> &crcs()
+    {
+        return _crcs;
+    }
 
-static bool process_empty_stream(const FileInfo &info)
-{
-    wchar_t *name = (wchar_t *)info._name.data();
+private:
+    const std::vector<uint32_t> &_sizes;
+    std::vector<uint32_t> _crcs;
+    size_t _index;
+    uint64_t _remaining;
+};
 
-    if (info.is_directory()) {
-        if (CreateDirectoryW(name, nullptr) == FALSE) {
-            fmt::print("CreateDirectoryW() failed {}\n", GetLastError());
-            return false;
+// Splits the decoded data of a folder into its files while the folder is
+// still being decoded. Every file is checked against its crc32 as soon as
+// its last byte has been written.
+class FolderWriter {
+public:
+    FolderWriter(const FileTable &files, uint32_t first, uint32_t num_files)
+        : _files(files), _next(first), _left(num_files), _info(&files, 0), _open(false), _remaining(0), _crc(0) {}
+
+    bool write(const uint8_t *data, size_t size)
+    {
+        while (size) {
+            if (!_open && !open_next()) {
+                return false;
+            }
+
+            size_t n = size < _remaining ? size : (size_t)_remaining;
+            _crc = crc32_update(_crc, data, n);
+            if (!_out.write(data, n)) {
+                return false;
+            }
+            data += n;
+            size -= n;
+            _remaining -= n;
+
+            if (_remaining == 0 && !close_current()) {
+                return false;
+            }
         }
-    } else {
-        if (!ensure_dir_exists(name)) {
-            fmt::print("ensure_dir_exists() failed\n");
-            return false;
+        return true;
+    }
+
+    // the folder is fully decoded, only empty files may be left
+    bool finish()
+    {
+        while (_left || _open) {
+            if (!_open && !open_next()) {
+                return false;
+            }
+            if (_remaining) {
+                fmt::print("folder ended in the middle of a file\n");
+                return false;
+            }
+            if (!close_current()) {
+                return false;
+            }
         }
-        HANDLE h = CreateFileW(name, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, info._attribute, NULL);
-        if (h == INVALID_HANDLE_VALUE) {
-            fmt::print("CreateFileW() failed {}\n", GetLastError());
+        return true;
+    }
+
+private:
+    bool open_next()
+    {
+        if (_left == 0) {
+            fmt::print("folder has more data than its files\n");
             return false;
         }
-        CloseHandle(h);
+        while (_files[_next].is_empty_stream()) {
+            _next++;
+        }
+
+        _info = _files[_next++];
+        _open = true;
+        _left--;
+        _remaining = _info.size();
+        _crc = 0;
+
+        print_extracted(_info);
+        return _out.open(_info);
+    }
+
+    bool close_current()
+    {
+        _out.close();
+        bool success = _crc == _info.crc();
+        if (!success) {
+            fmt::print("incorrect crc32\n");
+        }
+        _open = false;
+        return success;
     }
 
-    return true;
-}
+    const FileTable &_files;
+    uint32_t _next;
+    uint32_t _left;
+    FileInfo _info;
+    bool _open;
+    uint64_t _remaining;
+    uint32_t _crc;
+    OutputFile _out;
+};
 
-static bool write_file(const FileInfo &info, const uint8_t *out)
+void Archive::ExtractAll()
 {
-    const uint8_t *buffer = out + info._offset;
-    uint32_t crc = crc32(buffer, info._size);
-    if (info._crc != crc) {
-        fmt::print("incorrect crc32\n");
-        return false;
+    for (uint32_t i = 0; i < _files.size(); i++) {
+        if (_files[i].is_empty_stream() && !process_empty_stream(_files[i])) {
+            fmt::print("process_empty_stream() failed\n");
+        }
     }
 
-    wchar_t *name = (wchar_t *)info._name.data();
-    fmt::print(L"- {}\n", name);
-    if (!ensure_dir_exists(name)) {
-        fmt::print("ensure_dir_exists() failed\n");
-        return false;
+    // folders are independent of each other, every worker decompresses one
+    // folder and writes its files while the other workers are still decoding
+    bool success = parallel_for(_folders.size(), _num_threads, [this](uint32_t i) {
+        return extract_folder(i);
+    });
+    if (!success) {
+        fmt::print("extract_folder() failed\n");
     }
-    HANDLE h = CreateFileW(name, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, info._attribute, NULL);
-    if (h == INVALID_HANDLE_VALUE) {
-        fmt::print("CreateFileW() failed {}\n", GetLastError());
-        return false;
+}
+
+bool Archive::ExtractFile(const std::vector<std::string> &patterns)
+{
+    GlobSet globs;
+    std::string name;
+
+    for (auto &p : patterns) {
+        globs.add(p);
     }
 
-    DWORD written = 0;
-    DWORD size = info._size;
-    while (written < size) {
-        DWORD curr = 0;
-        if (WriteFile(h, buffer + written, size - written, &curr, nullptr) == FALSE) {
-            fmt::print("WirteFile() failed {}\n", GetLastError());
-            CloseHandle(h);
-            return false;
+    // plan first: the selected files of every folder and where the last of
+    // them ends, so decoding stops there and untouched folders are skipped
+    uint32_t num_folders = _folders.size();
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> selected(num_folders);
+    std::vector<uint64_t> needed(num_folders, 0);
+    std::vector<uint32_t> substream(num_folders, 0);
+
+    for (uint32_t i = 0; i < _files.size(); i++) {
+        FileInfo info = _files[i];
+        uint32_t j = 0;
+        if (!info.is_empty_stream()) {
+            j = substream[info.folder()]++;
+        }
+
+        name.assign(info.utf8_name(), info.utf8_size());
+        if (!globs.match(name)) {
+            continue;
+        }
+        if (info.is_empty_stream()) {
+            process_empty_stream(info);
+            continue;
         }
-        written += curr;
+
+        selected[info.folder()].emplace_back(i, j);
+        needed[info.folder()] = std::max(needed[info.folder()], info.offset() + info.size());
     }
-    CloseHandle(h);
 
-    return true;
-}
+    std::vector<uint32_t> folders;
+    for (uint32_t i = 0; i < num_folders; i++) {
+        if (!selected[i].empty()) {
+            folders.push_back(i);
+        }
+    }
 
-static bool match(const std::string &name, std::vector<std::regex> &v)
-{
-    for (auto &r : v) {
-        if (std::regex_match(name, r)) {
+    uint32_t num_threads = 1;
+    if (!folders.empty() && _num_threads > folders.size()) {
+        num_threads = _num_threads / folders.size();
+    }
+    return parallel_for(folders.size(), _num_threads, [&](uint32_t k) {
+        uint32_t index = folders[k];
+        if (_folders[index].is_stored()) {
+            for (auto &s : selected[index]) {
+                if (!write_stored(index, _files[s.first])) {
+                    fmt::print("write_stored() failed\n");
+                    return false;
+                }
+            }
             return true;
         }
-    }
-    return false;
+        if (_index.is_open() && _folders[index].can_checkpoint()) {
+            std::vector<uint32_t> files;
+            for (auto &s : selected[index]) {
+                files.push_back(s.first);
+            }
+            return extract_indexed(index, files);
+        }
+
+        std::vector<uint32_t> crcs;
+        PooledBuffer out = decompress_folder(index, crcs, num_threads, needed[index]);
+        if (!out.data()) {
+            fmt::print("decompress_folder() failed\n");
+            return false;
+        }
+
+        for (auto &s : selected[index]) {
+            FileInfo info = _files[s.first];
+            if (!write_file(info, out.data() + info.offset(), crcs[s.second])) {
+                fmt::print("write_file() failed\n");
+                return false;
+            }
+        }
+        return true;
+    });
 }
 
-static bool string_replace(std::string &str, const std::string &from, const std::string &to)
+// Decode only the runs of a folder around the selected files, each from the
+// last checkpoint before its first file. A file joins the run before it when
+// its own checkpoint is not past the end of that run.
+bool Archive::extract_indexed(uint32_t index, const std::vector<uint32_t> &files)
 {
-    std::size_t start_pos = str.find(from);
-    if (start_pos == std::string::npos)
+    auto &f = _folders[index];
+    size_t in_size;
+    const uint8_t *in = packed_stream(index, in_size);
+    if (!in) {
         return false;
-    str.replace(start_pos, from.length(), to);
-    return true;
-}
+    }
 
-static std::string translate(const std::string &pattern)
-{
-    std::size_t i = 0, n = pattern.size();
-    std::string result_string;
-
-    while (i < n) {
-        auto c = pattern[i];
-        i += 1;
-        if (c == '*') {
-            result_string += ".*";
-        } else if (c == '?') {
-            result_string += ".";
-        } else if (c == '[') {
-            auto j = i;
-            if (j < n && pattern[j] == '!') {
-                j += 1;
-            }
-            if (j < n && pattern[j] == ']') {
-                j += 1;
-            }
-            while (j < n && pattern[j] != ']') {
-                j += 1;
-            }
-            if (j >= n) {
-                result_string += "\\[";
-            } else {
-                auto stuff = std::string(pattern.begin() + i, pattern.begin() + j);
-                if (stuff.find("--") == std::string::npos) {
-                    string_replace(stuff, std::string{"\\"}, std::string{R"(\\)"});
-                } else {
-                    std::vector<std::string> chunks;
-                    std::size_t k = 0;
-                    if (pattern[i] == '!') {
-                        k = i + 2;
-                    } else {
-                        k = i + 1;
-                    }
-
-                    while (true) {
-                        k = pattern.find("-", k, j);
-                        if (k == std::string::npos) {
-                            break;
-                        }
-                        chunks.push_back(std::string(pattern.begin() + i, pattern.begin() + k));
-                        i = k + 1;
-                        k = k + 3;
-                    }
-
-                    chunks.push_back(std::string(pattern.begin() + i, pattern.begin() + j));
-                    // Escape backslashes and hyphens for set difference (--).
-                    // Hyphens that create ranges shouldn't be escaped.
-                    bool first = true;
-                    for (auto &s : chunks) {
-                        string_replace(s, std::string{"\\"}, std::string{R"(\\)"});
-                        string_replace(s, std::string{"-"}, std::string{R"(\-)"});
-                        if (first) {
-                            stuff += s;
-                            first = false;
-                        } else {
-                            stuff += "-" + s;
-                        }
-                    }
-                }
+    size_t k = 0;
+    while (k < files.size()) {
+        IMethod::Checkpoint cp = {0, 0, nullptr, 0, nullptr, 0};
+        _index.find(index, _files[files[k]].offset(), cp);
 
-                // Escape set operations (&&, ~~ and ||).
-                std::string result;
-                std::regex_replace(std::back_inserter(result),          // ressult
-                    stuff.begin(), stuff.end(),          // string
-                    std::regex(std::string{R"([&~|])"}), // pattern
-                    std::string{R"(\\\1)"});             // repl
-                stuff = result;
-                i = j + 1;
-                if (stuff[0] == '!') {
-                    stuff = "^" + std::string(stuff.begin() + 1, stuff.end());
-                } else if (stuff[0] == '^' || stuff[0] == '[') {
-                    stuff = "\\\\" + stuff;
-                }
-                result_string = result_string + "[" + stuff + "]";
-            }
-        } else {
-            // SPECIAL_CHARS
-            // closing ')', '}' and ']'
-            // '-' (a range in character set)
-            // '&', '~', (extended character set operations)
-            // '#' (comment) and WHITESPACE (ignored) in verbose mode
-            static std::string special_characters = "()[]{}?*+-|^$\\.&~# \t\n\r\v\f";
-            static std::map<int, std::string> special_characters_map;
-            if (special_characters_map.empty()) {
-                for (auto &sc : special_characters) {
-                    special_characters_map.insert(
-                        std::make_pair(static_cast<int>(sc), std::string{"\\"} + std::string(1, sc)));
-                }
+        uint64_t end = 0;
+        size_t last = k;
+        for (; last < files.size(); last++) {
+            FileInfo info = _files[files[last]];
+            IMethod::Checkpoint next;
+            if (last > k && _index.find(index, info.offset(), next) && next.unpack_offset > end) {
+                break;
             }
+            end = std::max(end, info.offset() + info.size());
+        }
 
-            if (special_characters.find(c) != std::string::npos) {
-                result_string += special_characters_map[static_cast<int>(c)];
-            } else {
-                result_string += c;
+        size_t size = end - cp.unpack_offset;
+        PooledBuffer out;
+        if (!out.alloc(size)) {
+            fmt::print("alloc failed\n");
+            return false;
+        }
+        bool success = f.resume(in, in_size, cp, out.data(), size);
+        if (!success) {
+            fmt::print("decompress folder {} failed\n", index);
+        }
+
+        for (; success && k < last; k++) {
+            FileInfo info = _files[files[k]];
+            const uint8_t *data = out.data() + (info.offset() - cp.unpack_offset);
+            if (!write_file(info, data, crc32_update(0, data, info.size()))) {
+                fmt::print("write_file() failed\n");
+                success = false;
             }
         }
+        if (!success) {
+            return false;
+        }
     }
-    return std::string{"(("} + result_string + std::string{R"()|[\r\n])$)"};
+    return true;
 }
 
-static std::regex compile_pattern(const std::string &pattern)
+bool Archive::BuildIndex(size_t interval)
 {
-    return std::regex(translate(pattern), std::regex::ECMAScript);
-}
+    CheckpointIndexWriter w;
+    std::string name = index_name(_name);
+    if (!w.open(name, _folders.size())) {
+        return false;
+    }
 
-void Archive::ExtractAll()
-{
-    auto it = _files_info.cbegin();
+    struct Saved {
+        size_t packed_offset;
+        size_t unpack_offset;
+        std::vector<uint8_t> state;
+        std::vector<uint8_t> history;
+    };
 
-    while (it->is_empty_stream()) {
-        if (!process_empty_stream(*it)) {
-            fmt::print("process_empty_stream() failed\n");
+    // every worker collects the checkpoints of one folder, they are written
+    // out in folder order as soon as the folders before are done
+    std::vector<std::vector<Saved>> saved(_folders.size());
+    uint64_t num_checkpoints = 0;
+    bool success = parallel_for_ordered(_folders.size(), _num_threads, [&](uint32_t i) {
+        auto &f = _folders[i];
+        if (!f.can_checkpoint()) {
+            return true;
         }
-        ++it;
-    }
 
-    uint32_t size = _folders.size();
-    for (uint32_t i = 0; i < size; i++) {
-        uint8_t *out = decompress_folder(i);
-        if (!out) {
-            fmt::print("decompress_folder() failed\n");
-            return;
+        size_t in_size;
+        const uint8_t *in = packed_stream(i, in_size);
+        if (!in) {
+            return false;
         }
-
-        while (it->_folder == i) {
-            if (!write_file(*it, out)) {
-                fmt::print("write_file() failed\n");
-                return;
+        return f.checkpoints(in, in_size, interval, [&saved, i](const IMethod::Checkpoint &cp) {
+            saved[i].push_back({cp.packed_offset, cp.unpack_offset,
+                                std::vector<uint8_t>(cp.state, cp.state + cp.state_size),
+                                std::vector<uint8_t>(cp.history, cp.history + cp.history_size)});
+            return true;
+        });
+    }, [&](uint32_t i) {
+        for (auto &s : saved[i]) {
+            IMethod::Checkpoint cp = {s.packed_offset, s.unpack_offset,
+                                      s.state.empty() ? nullptr : s.state.data(), s.state.size(),
+                                      s.history.data(), s.history.size()};
+            if (!w.add(i, cp)) {
+                return false;
             }
-            ++it;
         }
-
-        delete[] out;
+        num_checkpoints += saved[i].size();
+        std::vector<Saved>().swap(saved[i]);
+        return true;
+    });
+    if (!success || !w.finish(_file.size(), _next_hdr_crc)) {
+        fmt::print("building {} failed\n", name);
+        return false;
     }
 
-    assert(it == _files_info.cend());
+    fmt::print("{} checkpoints saved to {}\n", num_checkpoints, name);
+    return true;
 }
 
-bool Archive::ExtractFile(std::vector<std::string> &patterns)
+bool Archive::load_index()
 {
-    std::vector<std::regex> v;
-    uint8_t *out = nullptr;
-    uint32_t curr_folder = 0;
-    bool decompressed = false;
+    return _index.open(index_name(_name), _file.size(), _next_hdr_crc, _folders.size());
+}
 
-    for (auto &p : patterns) {
-        v.push_back(compile_pattern(p));
+bool Archive::ReadFile(uint32_t index, std::vector<uint8_t> &data)
+{
+    if (index >= _files.size()) {
+        return false;
+    }
+    FileInfo info = _files[index];
+    data.clear();
+    if (info.is_empty_stream()) {
+        return true;
     }
 
-    for (auto it = _files_info.cbegin(); it != _files_info.cend(); ++it) {
-        auto name = utf16_to_utf8((wchar_t *)it->_name.data());
-        if (match(name, v)) {
-            if (it->is_empty_stream()) {
-                process_empty_stream(*it);
-            } else {
-                if (it->_folder != curr_folder) {
-                    if (decompressed) {
-                        delete[] out;
-                        decompressed = false;
-                    }
-                    curr_folder = it->_folder;
-                }
-
-                if (!decompressed) {
-                    out = decompress_folder(curr_folder);
-                    if (!out) {
-                        fmt::print("decompress_folder() failed\n");
-                        return false;
-                    }
-                    decompressed = true;
-                }
-
-                if (!write_file(*it, out)) {
-                    fmt::print("write_file() failed\n");
-                    return false;
-                }
-            }
+    auto &f = _folders[info.folder()];
+    uint64_t end = info.offset() + info.size();
+    IMethod::Checkpoint cp = {0, 0, nullptr, 0, nullptr, 0};
+    if (_index.is_open() && f.can_checkpoint()) {
+        size_t in_size;
+        const uint8_t *in = packed_stream(info.folder(), in_size);
+        if (!in) {
+            return false;
+        }
+        _index.find(info.folder(), info.offset(), cp);
+        data.resize(end - cp.unpack_offset);
+        if (!f.resume(in, in_size, cp, data.data(), data.size())) {
+            fmt::print("decompress folder {} failed\n", info.folder());
+            return false;
+        }
+        data.erase(data.begin(), data.begin() + (info.offset() - cp.unpack_offset));
+    } else {
+        std::vector<uint32_t> crcs;
+        PooledBuffer out = decompress_folder(info.folder(), crcs, _num_threads, end);
+        if (!out.data()) {
+            return false;
         }
+        data.assign(out.data() + info.offset(), out.data() + end);
+    }
+
+    if (crc32_update(0, data.data(), data.size()) != info.crc()) {
+        fmt::print("incorrect crc32\n");
+        return false;
     }
     return true;
 }
@@ -328,34 +432,28 @@ void Archive::ListFiles()
 {
     fmt::print("{:<20} {:<10} {:<15} {:<10} File Name\n", "Last Write Time", "Attributes", "File Size", "CRC");
     auto s = fmt::memory_buffer();
-    for (auto it = _files_info.cbegin(); it != _files_info.cend(); ++it) {
-        if (it->has_mtime()) {
-            ULARGE_INTEGER ui;
-            ui.QuadPart = it->_mtime;
-            FILETIME ft{ui.u.LowPart, ui.u.HighPart}, local_ft;
-            SYSTEMTIME st;
-            if (FileTimeToLocalFileTime(&ft, &local_ft) == FALSE) {
-                fmt::print("Failed to convert FILETIME to local FILETIME\n");
-                return;
-            }
-            if (FileTimeToSystemTime(&local_ft, &st) == FALSE) {
-                fmt::print("Failed to convert FILETIME {} to SYSTEMTIME\n", it->_mtime);
+    for (uint32_t i = 0; i < _files.size(); i++) {
+        FileInfo it = _files[i];
+        if (it.has_mtime()) {
+            LocalTime t;
+            if (!filetime_to_local(it.mtime(), t)) {
                 return;
             }
-            fmt::format_to(std::back_inserter(s), "{}-{:02}-{:02} {:02}:{:02}:{:02}  ", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+            fmt::format_to(std::back_inserter(s), "{}-{:02}-{:02} {:02}:{:02}:{:02}  ", t.year, t.month, t.day, t.hour, t.minute, t.second);
         }
-        if (it->has_attribute()) {
+        if (it.has_attribute()) {
             char a[6];
-            a[0] = (char)(it->is_directory() ? 'D' : '.');
-            a[1] = (char)(it->is_readonly() ? 'R' : '.');
-            a[2] = (char)(it->is_hidden() ? 'H' : '.');
-            a[3] = (char)(it->is_system() ? 'S' : '.');
-            a[4] = (char)(it->is_archive() ? 'A' : '.');
+            a[0] = (char)(it.is_directory() ? 'D' : '.');
+            a[1] = (char)(it.is_readonly() ? 'R' : '.');
+            a[2] = (char)(it.is_hidden() ? 'H' : '.');
+            a[3] = (char)(it.is_system() ? 'S' : '.');
+            a[4] = (char)(it.is_archive() ? 'A' : '.');
             a[5] = 0;
             fmt::format_to(std::back_inserter(s), "{:<10} ", a);
         }
-        fmt::format_to(std::back_inserter(s), "{:<15} {:0<#10x} {}", it->_size, it->_crc, utf16_to_utf8((wchar_t *)it->_name.data()));
-        if (it->is_directory()) {
+        fmt::format_to(std::back_inserter(s), "{:<15} {:0<#10x} ", it.size(), it.crc());
+        s.append(it.utf8_name(), it.utf8_name() + it.utf8_size());
+        if (it.is_directory()) {
             s.push_back('/');
         }
         s.push_back('\n');
@@ -363,9 +461,234 @@ void Archive::ListFiles()
     fmt::print("{}\n", fmt::to_string(s));
 }
 
-void Archive::TestArchive()
+bool Archive::TestArchive()
+{
+    uint32_t num_folders = _folders.size();
+    std::vector<uint32_t> first_digest(num_folders + 1, 0);
+    uint32_t num_files = 0;
+    uint64_t packed = 0;
+    uint64_t unpacked = 0;
+    for (uint32_t i = 0; i < num_folders; i++) {
+        first_digest[i + 1] = first_digest[i] + _substream_sizes[i].size();
+        num_files += _substream_sizes[i].size();
+        unpacked += _folders[i].get_unpack_size();
+        for (uint32_t k = 0; k < _folders[i].num_packed_streams(); k++) {
+            packed += _pack_size[_folders[i]._start_packed_stream_index + k];
+        }
+    }
+
+    // After a failure no new folder is started, but the ones before it are
+    // all running and get finished, so the lowest failing folder is the
+    // first failure of the archive
+    uint32_t num_threads = num_folders && _num_threads > num_folders ? _num_threads / num_folders : 1;
+    std::mutex lock;
+    uint32_t failed = UINT32_MAX;
+    std::string failure;
+
+    auto start = std::chrono::steady_clock::now();
+    bool success = parallel_for(num_folders, _num_threads, [&](uint32_t i) {
+        std::string error;
+        if (test_folder(i, num_threads, first_digest[i], error)) {
+            return true;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (i < failed) {
+            failed = i;
+            failure = error;
+        }
+        return false;
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!success) {
+        fmt::print("{}\n", failure);
+        return false;
+    }
+    fmt::print("{} files in {} folders, {:.1f} MiB packed, {:.1f} MiB unpacked in {:.3f} s: {:.1f} MiB/s\n"
+               "Everything is Ok\n", num_files, num_folders, packed / 1048576.0, unpacked / 1048576.0, seconds,
+               seconds > 0 ? unpacked / 1048576.0 / seconds : 0.0);
+    return true;
+}
+
+// read ahead of the CRC and dropped after it, so checking a large store
+// neither waits for the disk nor pushes everything else out of the cache
+constexpr static uint64_t QUICK_TEST_STEP = 8 << 20;
+
+bool Archive::QuickTest()
+{
+    std::vector<uint32_t> streams;
+    uint64_t packed = 0;
+    for (uint32_t p = 0; p < _pack_size.size(); p++) {
+        if (p < _pack_digest._number && _pack_digest.test(p)) {
+            streams.push_back(p);
+            packed += _pack_size[p];
+        }
+    }
+    // an archive of empty files has nothing to check
+    if (streams.empty() && !_pack_size.empty()) {
+        fmt::print("no packed stream has a CRC, only -t can check this archive\n");
+        return false;
+    }
+
+    // as in TestArchive(), the lowest failing stream is the first failure
+    std::mutex lock;
+    uint32_t failed = UINT32_MAX;
+    std::string failure;
+
+    auto start = std::chrono::steady_clock::now();
+    bool success = parallel_for(streams.size(), _num_threads, [&](uint32_t k) {
+        uint32_t p = streams[k];
+        uint64_t offset = _pack_offset[p];
+        uint64_t size = _pack_size[p];
+        std::string error;
+        if (!_file.contains(offset, size)) {
+            error = fmt::format("packed stream {}: out of range", p);
+        } else {
+            uint32_t crc = 0;
+            _file.will_need(offset, std::min(size, QUICK_TEST_STEP));
+            for (uint64_t pos = 0; pos < size;) {
+                uint64_t n = std::min(size - pos, QUICK_TEST_STEP);
+                _file.will_need(offset + pos + n, std::min(size - pos - n, QUICK_TEST_STEP));
+                crc = crc32_update(crc, _file.data() + offset + pos, (size_t)n);
+                _file.done_with(offset + pos, n);
+                pos += n;
+            }
+            if (crc == _pack_digest._crcs[p]) {
+                return true;
+            }
+            error = fmt::format("packed stream {}: CRC mismatch", p);
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (p < failed) {
+            failed = p;
+            failure = error;
+        }
+        return false;
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!success) {
+        fmt::print("{}\n", failure);
+        return false;
+    }
+    if (streams.size() < _pack_size.size()) {
+        fmt::print("{} packed streams have no CRC and were not checked\n", _pack_size.size() - streams.size());
+    }
+    fmt::print("{} packed streams, {:.1f} MiB in {:.3f} s: {:.1f} MiB/s\nEverything is Ok\n", streams.size(),
+               packed / 1048576.0, seconds, seconds > 0 ? packed / 1048576.0 / seconds : 0.0);
+    return true;
+}
+
+bool Archive::test_folder(uint32_t index, uint32_t num_threads, uint32_t first_digest, std::string &error)
+{
+    auto &f = _folders[index];
+    std::vector<InStream> in;
+    if (!packed_streams(index, in)) {
+        error = fmt::format("folder {}: packed streams out of range", index);
+        return false;
+    }
+
+    // a damaged packed stream would only confuse the decoder
+    for (uint32_t k = 0; k < in.size(); k++) {
+        uint32_t p = f._start_packed_stream_index + k;
+        if (p < _pack_digest._number && _pack_digest.test(p) &&
+            crc32_update(0, in[k].data, in[k].size) != _pack_digest._crcs[p]) {
+            error = fmt::format("packed stream {} of folder {}: CRC mismatch", p, index);
+            return false;
+        }
+    }
+
+    // every chunk is hashed for the folder and for its file while in cache
+    bool folder_digest = index < _unpack_digest._number && _unpack_digest.test(index);
+    uint32_t folder_crc = 0;
+    SubstreamCrc sc(_substream_sizes[index]);
+    auto check = [&](const uint8_t *data, size_t size) {
+        if (folder_digest) {
+            folder_crc = crc32_update(folder_crc, data, size);
+        }
+        return _substream_sizes[index].empty() || sc.update(data, size);
+    };
+
+    size_t size = f.get_unpack_size();
+    bool success;
+    if (f.is_stored()) {
+        success = in[0].size >= size && check(in[0].data, size);
+    } else if (f.can_stream() && (num_threads == 1 || (_memory_limit && size > _memory_limit))) {
+        // nothing to split the folder with, no buffer for all of it either
+        success = f.decompress_stream(in[0].data, in[0].size, _memory_limit, check, UINT64_MAX, num_threads);
+    } else {
+        PooledBuffer out;
+        if (!out.alloc(size)) {
+            error = fmt::format("folder {}: alloc failed with {}", index, size);
+            return false;
+        }
+        success = f.decompress(in, out.data(), size, check, num_threads);
+    }
+    if (!success) {
+        error = fmt::format("folder {}: decoding failed", index);
+        return false;
+    }
+
+    if (folder_digest && folder_crc != _unpack_digest._crcs[index]) {
+        error = fmt::format("folder {}: CRC mismatch", index);
+        return false;
+    }
+
+    uint32_t num_substreams = _substream_sizes[index].size();
+    uint32_t i = _folder_first_file[index];
+    for (uint32_t j = 0; j < num_substreams; i++) {
+        FileInfo info = _files[i];
+        if (info.is_empty_stream()) {
+            continue;
+        }
+        uint32_t d = first_digest + j;
+        if (d < _substreams_digest._number && _substreams_digest.test(d) &&
+            sc.crcs()[j] != _substreams_digest._crcs[d]) {
+            error = fmt::format("{}: CRC mismatch", std::string(info.utf8_name(), info.utf8_size()));
+            return false;
+        }
+        j++;
+    }
+    return true;
+}
+
+void Archive::Benchmark()
 {
+    uint64_t packed = 0;
+    uint64_t unpacked = 0;
+    double best = 0;
+
+    // best of three, the first run also pages the archive in
+    for (int run = 0; run < 3; run++) {
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < _folders.size(); i++) {
+            auto &f = _folders[i];
+            std::vector<InStream> in;
+            PooledBuffer out;
+            if (!packed_streams(i, in) || !out.alloc(f.get_unpack_size())) {
+                fmt::print("folder {} can't be read\n", i);
+                return;
+            }
+            if (!f.decompress(in, out.data(), f.get_unpack_size())) {
+                fmt::print("decompressing folder {} failed\n", i);
+                return;
+            }
+            if (run == 0) {
+                for (auto &s : in) {
+                    packed += s.size;
+                }
+                unpacked += f.get_unpack_size();
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (run == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
 
+    fmt::print("{} folders, {:.1f} MiB packed, {:.1f} MiB unpacked in {:.3f} s: {:.1f} MiB/s\n", _folders.size(),
+               packed / 1048576.0, unpacked / 1048576.0, best, best > 0 ? unpacked / 1048576.0 / best : 0.0);
 }
 
 bool Archive::write_signature()
@@ -383,20 +706,23 @@ bool Archive::write_signature()
 
 bool Archive::read_signature()
 {
-    size_t sz = 0;
+    if (!_file.contains(0, SIGNATURE_HEADER_SIZE)) {
+        return false;
+    }
 
-    sz += fread(&_start_hdr_crc, 1, sizeof(uint32_t), _fp);
-    sz += fread(&_next_hdr_offset, 1, sizeof(uint64_t), _fp);
-    sz += fread(&_next_hdr_size, 1, sizeof(uint64_t), _fp);
-    sz += fread(&_next_hdr_crc, 1, sizeof(uint32_t), _fp);
+    const uint8_t *p = _file.data() + 8;
+    ::memcpy(&_start_hdr_crc, p, sizeof(uint32_t));
+    ::memcpy(&_next_hdr_offset, p + 4, sizeof(uint64_t));
+    ::memcpy(&_next_hdr_size, p + 12, sizeof(uint64_t));
+    ::memcpy(&_next_hdr_crc, p + 20, sizeof(uint32_t));
 
-    return sz == 24;
+    return true;
 }
 
 bool Archive::read_bitmap_digest(ByteArray &arr, uint32_t number, BitmapDigest &digest)
 {
     uint8_t all_defined = arr.read_uint8();
-    if (!digest.init(all_defined, number)) {
+    if (!digest.init(_arena, all_defined, number)) {
         fmt::print("init digest failed\n");
         return false;
     }
@@ -429,8 +755,12 @@ bool Archive::read_pack_info(ByteArray &arr)
         arr.skip_data();
     }
 
+    _pack_offset.resize(num_pack_streams);
+    uint64_t offset = SIGNATURE_HEADER_SIZE + _pack_pos;
     for (uint64_t i = 0; i < num_pack_streams; i++) {
         _pack_size[i] = arr.read_number();
+        _pack_offset[i] = offset;
+        offset += _pack_size[i];
     }
 
     t = arr.read_uint8();
@@ -467,7 +797,7 @@ bool Archive::read_coders_info(ByteArray &arr)
             return false;
         }
         auto &f = _folders[i];
-        f._coders.resize(num_coders);
+        f._coders = _arena.alloc_array<Coder>(num_coders);
         for (uint64_t j = 0; j < num_coders; j++) {
             auto &c = f._coders[j];
             c._flag = arr.read_uint8();
@@ -489,11 +819,7 @@ bool Archive::read_coders_info(ByteArray &arr)
 
             if (c.has_attributes()) {
                 c._property_size = arr.read_num_u32();
-                c._property = new uint8_t[c._property_size];
-                // TODO implement memory allocator for small chunk (<32 bytes)
-                if (!c._property) {
-                    return false;
-                }
+                c._property = _arena.alloc_array<uint8_t>(c._property_size).data();
                 arr.read_bytes(c._property, c._property_size);
             }
         }
@@ -507,7 +833,7 @@ bool Archive::read_coders_info(ByteArray &arr)
             return false;
         }
         if (num_bind_pairs != 0) {
-            f._bind_pairs.resize(num_bind_pairs);
+            f._bind_pairs = _arena.alloc_array<std::pair<uint8_t, uint8_t>>(num_bind_pairs);
             for (uint16_t j = 0; j < num_bind_pairs; j++) {
                 f._bind_pairs[j].first = arr.read_num_u8();
                 f._bind_pairs[j].second = arr.read_num_u8();
@@ -515,11 +841,15 @@ bool Archive::read_coders_info(ByteArray &arr)
         }
         uint16_t num_packed_streams = f._num_in_streams_total - num_bind_pairs;
         if (num_packed_streams != 1) {
-            f._packed_streams_index.resize(num_packed_streams);
+            f._packed_streams_index = _arena.alloc_array<uint32_t>(num_packed_streams);
             for (uint16_t j = 0; j < num_packed_streams; j++) {
                 f._packed_streams_index[j] = arr.read_num_u32();
             }
         }
+        if (!f.bind(_arena)) {
+            fmt::print("Incorrect coders in folder {}\n", i);
+            return false;
+        }
         f._start_packed_stream_index = packed_stream_index;
         if (num_packed_streams > _pack_size.size() - packed_stream_index) {
             fmt::print("Too many packed streams in folder {}\n", i);
@@ -595,12 +925,58 @@ bool Archive::read_sub_streams_info(ByteArray &arr)
     return true;
 }
 
-bool Archive::read_files_info(ByteArray& arr)
+// The names are copied as one block, then split at their NULs
+bool Archive::read_names(ByteArray &arr, uint32_t num_files, uint64_t size)
+{
+    auto &names = _files._names;
+    if (size / 2 > UINT32_MAX) {
+        return false;
+    }
+    names.resize(size / 2);
+    arr.read_bytes((uint8_t *)names.data(), size);
+
+    uint32_t i = 0;
+    for (uint32_t pos = 0; pos < names.size(); pos++) {
+        if (names[pos] == 0) {
+            if (i == num_files) {
+                break;
+            }
+            _files._name_offset[++i] = pos + 1;
+        }
+    }
+    if (i != num_files || _files._name_offset[i] != names.size()) {
+        fmt::print("{} names for {} files\n", i, num_files);
+        return false;
+    }
+    return true;
+}
+
+// listing and matching work on UTF-8, every name is converted once here
+void Archive::make_utf8_names()
+{
+    auto &f = _files;
+    uint32_t num_files = f.size();
+    if (f._names.empty()) {
+        f._names.assign(num_files, 0);
+        for (uint32_t i = 0; i < num_files; i++) {
+            f._name_offset[i + 1] = i + 1;
+        }
+    }
+
+    f._utf8_names.clear();
+    f._utf8_names.reserve(f._names.size());
+    for (uint32_t i = 0; i < num_files; i++) {
+        utf16_to_utf8_append(f._names.data() + f._name_offset[i], f._utf8_names);
+        f._utf8_offset[i + 1] = (uint32_t)f._utf8_names.size();
+    }
+}
+
+bool Archive::read_files_info(ByteArray& arr)
 {
     uint32_t num_files = arr.read_num_u32();
-    _files_info.resize(num_files);
-    uint32_t num_empty_streams = 0;
-    std::map<uint32_t, uint32_t> m;
+    _files.resize(num_files);
+    // file index of every empty stream
+    std::vector<uint32_t> empty_streams;
 
     while (true) {
         uint8_t t = arr.read_uint8();
@@ -617,30 +993,30 @@ bool Archive::read_files_info(ByteArray& arr)
             arr.skip_data(size);
             break;
         case Property::EMPTY_STREAM:
-            if (!bm.init(num_files)) {
+            if (!bm.init(_arena, num_files)) {
                 fmt::print("Bitmap.init({}) failed\n", num_files);
                 return false;
             }
-            arr.read_bytes(bm._bitset, size);
+            // the bitmap sits between other header objects in the arena
+            arr.read_bytes(bm._bitset, std::min<uint64_t>(size, bm._size));
+            arr.skip_data(size - std::min<uint64_t>(size, bm._size));
             for (uint32_t i = 0; i < num_files; i++) {
                 if (bm.test(i)) {
-                    _files_info[i].set_empty_stream();
-                    m[num_empty_streams] = i;
-                    num_empty_streams++;
+                    _files._flags[i] |= F_F_EMPTY_STREAM;
+                    empty_streams.push_back(i);
                 }
             }
             break;
         case Property::EMPTY_FILE:
-            if (!bm.init(num_empty_streams)) {
-                fmt::print("Bitmap.init({}) failed\n", num_empty_streams);
+            if (!bm.init(_arena, empty_streams.size())) {
+                fmt::print("Bitmap.init({}) failed\n", empty_streams.size());
                 return false;
             }
-            arr.read_bytes(bm._bitset, size);
-            for (uint32_t i = 0; i < num_empty_streams; i++) {
+            arr.read_bytes(bm._bitset, std::min<uint64_t>(size, bm._size));
+            arr.skip_data(size - std::min<uint64_t>(size, bm._size));
+            for (uint32_t i = 0; i < empty_streams.size(); i++) {
                 if (bm.test(i)) {
-                    uint32_t j = m[i];
-                    _files_info[j].set_empty_file();
-                    _files_info[j]._size = 0;
+                    _files._flags[empty_streams[i]] |= F_F_EMPTY_FILE;
                 }
             }
             break;
@@ -659,14 +1035,9 @@ bool Archive::read_files_info(ByteArray& arr)
                 fmt::print("Incorrect size in FileName which is {}\n", size);
                 return false;
             }
-            for (uint32_t i = 0; i < num_files; i++) {
-                while (true) {
-                    uint16_t v = arr.read_uint16();
-                    _files_info[i]._name.push_back(v);
-                    if (v == 0) {
-                        break;
-                    }
-                }
+            if (!read_names(arr, num_files, size)) {
+                fmt::print("read NAME failed\n");
+                return false;
             }
             break;
         case Property::CREATION_TIME:
@@ -698,6 +1069,8 @@ bool Archive::read_files_info(ByteArray& arr)
             break;
         }
     }
+
+    make_utf8_names();
     return true;
 }
 
@@ -783,7 +1156,7 @@ bool Archive::read_header(ByteArray &arr)
     return true;
 }
 
-void Archive::write_decompressed_header(uint8_t *buf, size_t buf_len)
+void Archive::write_decompressed_header(const uint8_t *buf, size_t buf_len)
 {
     auto const pos = _name.find_last_of("/\\") + 1;
     std::string basename = _name.substr(pos);
@@ -822,29 +1195,16 @@ void Archive::write_decompressed_header(uint8_t *buf, size_t buf_len)
         return;
     }
 
-    uint64_t copied = 0;
-    uint8_t tmp[1024];
-    size_t sz;
-    fseek(_fp, SIGNATURE_HEADER_SIZE, SEEK_SET);
-    while (copied < _pack_pos) {
-        if (copied + 1024 <= _pack_pos) {
-            sz = 1024;
-        } else {
-            sz = _pack_pos - copied;
-        }
-        if (fread(tmp, 1, sz, _fp) != sz) {
-            fmt::print("fread() failed {}/{}", copied, _pack_pos);
-            fclose(new_fp);
-            return;
-        }
-
-        if (fwrite(tmp, 1, sz, new_fp) != sz) {
-            fmt::print("fwrite() failed {}/{}", copied, _pack_pos);
-            fclose(new_fp);
-            return;
-        }
+    if (!_file.contains(SIGNATURE_HEADER_SIZE, _pack_pos)) {
+        fmt::print("packed streams out of range\n");
+        fclose(new_fp);
+        return;
+    }
 
-        copied += sz;
+    if (fwrite(_file.data() + SIGNATURE_HEADER_SIZE, 1, _pack_pos, new_fp) != _pack_pos) {
+        fmt::print("fwrite() failed {}\n", _pack_pos);
+        fclose(new_fp);
+        return;
     }
 
     if (fwrite(buf, 1, buf_len, new_fp) != buf_len) {
@@ -859,105 +1219,240 @@ void Archive::write_decompressed_header(uint8_t *buf, size_t buf_len)
 
 uint8_t * Archive::decompress_header()
 {
-    bool success = true;
-    size_t src_len = _pack_size[0];
-    size_t dest_len = _folders[0].get_unpack_size();
+    std::vector<InStream> src;
+    if (_folders.empty() || !packed_streams(0, src)) {
+        return nullptr;
+    }
 
+    size_t dest_len = _folders[0].get_unpack_size();
     uint8_t *dest = new uint8_t[dest_len];
     if (!dest) {
         fmt::print("malloc() failed\n");
         return nullptr;
     }
 
-    uint8_t *src = new uint8_t[src_len];
-    if (!src) {
+    bool success = _folders[0].decompress(src, dest, dest_len);
+    if (!success) {
+        fmt::print("decompressing the header failed\n");
         delete[] dest;
-        fmt::print("malloc() failed\n");
+        dest = nullptr;
+    }
+
+    return dest;
+}
+
+const uint8_t *Archive::packed_stream(uint32_t index, size_t &size)
+{
+    auto &f = _folders[index];
+    if (f.num_packed_streams() != 1) {
+        fmt::print("folder {} has {} packed streams\n", index, f.num_packed_streams());
+        return nullptr;
+    }
+    uint64_t offset = _pack_offset[f._start_packed_stream_index];
+    size = _pack_size[f._start_packed_stream_index];
+    if (!_file.contains(offset, size)) {
+        fmt::print("packed stream of folder {} out of range\n", index);
         return nullptr;
     }
 
-    fseek(_fp, SIGNATURE_HEADER_SIZE + _pack_pos , SEEK_SET);
-    fread(src, 1, src_len, _fp);
+    _file.will_need(offset, size);
+    return _file.data() + offset;
+}
 
-    auto &c = _folders[0]._coders[0];
-    if (c.is_lzma()) {
-        int err = IMethod::lzma_decompress(dest, &dest_len, src, &src_len, c._property, c._property_size);
-        if (err) {
-            fmt::print("lzma_decompress() error {}\n", err);
-            success = false;
-        }
-    } else if (c.is_zstd()) {
-        int err = IMethod::zstd_decompress(dest, dest_len, src, src_len);
-        if (err) {
-            fmt::print("zstd_decompress() error {}\n", err);
-            success = false;
+bool Archive::packed_streams(uint32_t index, std::vector<InStream> &streams)
+{
+    auto &f = _folders[index];
+    streams.clear();
+    for (uint32_t i = 0; i < f.num_packed_streams(); i++) {
+        uint64_t offset = _pack_offset[f._start_packed_stream_index + i];
+        uint64_t size = _pack_size[f._start_packed_stream_index + i];
+        if (!_file.contains(offset, size)) {
+            fmt::print("packed stream {} of folder {} out of range\n", i, index);
+            return false;
         }
-    } else {
-        fmt::print("unknown coder id\n");
-        success = false;
+        streams.push_back(InStream{_file.data() + offset, (size_t)size});
     }
 
-    if (!success) {
-        delete[] dest;
-        dest = nullptr;
+    // ask for all of them at once, the kernel reads them ahead side by side
+    // while the coders work through the first
+    for (uint32_t i = 0; i < f.num_packed_streams(); i++) {
+        _file.will_need(_pack_offset[f._start_packed_stream_index + i], streams[i].size);
     }
-
-    delete[] src;
-    return dest;
+    return true;
 }
 
-uint8_t *Archive::decompress_folder(uint32_t index)
+PooledBuffer Archive::decompress_folder(uint32_t index, std::vector<uint32_t> &crcs, uint32_t num_threads,
+                                        uint64_t limit)
 {
     auto &f = _folders[index];
     size_t out_size = f.get_unpack_size();
-    size_t in_size = _pack_size[f._start_packed_stream_index];
-    uint8_t *in = new uint8_t[in_size];
-    if (!in) {
+    if (limit < out_size && f.can_stream()) {
+        out_size = limit;
+    }
+
+    // decode straight from the mapping
+    std::vector<InStream> in;
+    if (!packed_streams(index, in)) {
+        return PooledBuffer();
+    }
+
+    PooledBuffer out;
+    if (!out.alloc(out_size)) {
         fmt::print("alloc failed\n");
-        return nullptr;
+        return PooledBuffer();
     }
-    off_t offset = SIGNATURE_HEADER_SIZE + _pack_pos;
-    for (uint32_t i = 0; i < _pack_size.size(); i++) {
-        if (i == f._start_packed_stream_index) {
+    SubstreamCrc sc(_substream_sizes[index]);
+    bool success = f.decompress(in, out.data(), out_size, [&sc](const uint8_t *data, size_t size) {
+        return sc.update(data, size);
+    }, num_threads);
+    if (!success) {
+        fmt::print("decompress folder failed\n");
+        return PooledBuffer();
+    }
+
+    crcs.swap(sc.crcs());
+    return out;
+}
+
+bool Archive::extract_folder(uint32_t index)
+{
+    auto &f = _folders[index];
+    if (f.is_stored()) {
+        return extract_stored(index);
+    }
+
+    // threads not needed for decoding whole folders side by side go to the
+    // coders that can split a single folder
+    uint32_t num_folders = _folders.size();
+    uint32_t num_threads = num_folders && _num_threads > num_folders ? _num_threads / num_folders : 1;
+
+    if (_memory_limit && f.get_unpack_size() > _memory_limit && f.can_stream()) {
+        return extract_folder_stream(index, num_threads);
+    }
+
+    std::vector<uint32_t> crcs;
+    PooledBuffer out = decompress_folder(index, crcs, num_threads);
+    if (!out.data()) {
+        fmt::print("decompress_folder() failed\n");
+        return false;
+    }
+
+    bool success = true;
+    std::vector<FileInfo> files;
+    uint32_t num_substreams = _substream_sizes[index].size();
+    uint32_t i = _folder_first_file[index];
+    for (uint32_t j = 0; j < num_substreams; i++) {
+        FileInfo info = _files[i];
+        if (info.is_empty_stream()) {
+            continue;
+        }
+        if (_async_io) {
+            // files are only queued here and written together below
+            if (info.crc() != crcs[j]) {
+                fmt::print("incorrect crc32\n");
+                success = false;
+                break;
+            }
+            print_extracted(info);
+            files.push_back(info);
+        } else if (!write_file(info, out.data() + info.offset(), crcs[j])) {
+            fmt::print("write_file() failed\n");
+            success = false;
             break;
         }
-        offset += _pack_size[i];
+        j++;
     }
 
-    fseek(_fp, offset, SEEK_SET);
-    fread(in, in_size, 1, _fp);
+    if (success && !files.empty() && !uring_write_files(files, out.data())) {
+        fmt::print("uring_write_files() failed\n");
+        success = false;
+    }
+    return success;
+}
 
-    uint8_t *out = new uint8_t[out_size];
-    if (!out) {
-        fmt::print("alloc failed\n");
-        delete[] in;
-        return nullptr;
+bool Archive::extract_stored(uint32_t index)
+{
+    auto &f = _folders[index];
+    _file.will_need(_pack_offset[f._start_packed_stream_index], _pack_size[f._start_packed_stream_index]);
+
+    uint32_t num_substreams = _substream_sizes[index].size();
+    uint32_t i = _folder_first_file[index];
+    for (uint32_t j = 0; j < num_substreams; i++) {
+        FileInfo info = _files[i];
+        if (info.is_empty_stream()) {
+            continue;
+        }
+        if (!write_stored(index, info)) {
+            fmt::print("write_stored() failed\n");
+            return false;
+        }
+        j++;
     }
-    if (!f.decompress(in, in_size, out, out_size)) {
-        fmt::print("decompress folder failed\n");
-        delete[] in;
-        delete[] out;
-        return nullptr;
+    return true;
+}
+
+bool Archive::write_stored(uint32_t index, const FileInfo &info)
+{
+    auto &f = _folders[index];
+    uint64_t offset = _pack_offset[f._start_packed_stream_index] + info.offset();
+    if (info.offset() + info.size() > _pack_size[f._start_packed_stream_index] || !_file.contains(offset, info.size())) {
+        fmt::print("stored data of folder {} out of range\n", index);
+        return false;
     }
 
-    delete[] in;
-    return out;
+    // the check reads the pages the copy below takes from the page cache
+    if (crc32_update(0, _file.data() + offset, info.size()) != info.crc()) {
+        fmt::print("incorrect crc32\n");
+        return false;
+    }
+
+    print_extracted(info);
+    OutputFile out;
+    return out.open(info) && out.write_from(_file, offset, info.size());
+}
+
+bool Archive::extract_folder_stream(uint32_t index, uint32_t num_threads)
+{
+    auto &f = _folders[index];
+    size_t in_size;
+    const uint8_t *in = packed_stream(index, in_size);
+    if (!in) {
+        return false;
+    }
+
+    FolderWriter w(_files, _folder_first_file[index], _substream_sizes[index].size());
+    bool success = f.decompress_stream(in, in_size, _memory_limit, [&w](const uint8_t *data, size_t size) {
+        return w.write(data, size);
+    }, UINT64_MAX, num_threads);
+    if (!success) {
+        fmt::print("decompress folder {} failed\n", index);
+        return false;
+    }
+
+    return w.finish();
 }
 
 void Archive::reset()
 {
     _pack_pos = 0;
     _pack_size.clear();
+    _pack_offset.clear();
     _pack_digest.reset();
 
     _folders.clear();
     _unpack_digest.reset();
+
+    _substream_sizes.clear();
+    _substreams_digest.reset();
+    _files.clear();
+    _folder_first_file.clear();
+
+    _arena.release();
 }
 
 bool Archive::read_archive()
 {
     bool success;
-    uint8_t *buf = nullptr;
 
     success = read_signature();
     if (!success) {
@@ -965,15 +1460,18 @@ bool Archive::read_archive()
         return success;
     }
 
-    fseek(_fp, _next_hdr_offset, SEEK_CUR);
-    buf = new uint8_t[_next_hdr_size];
-    if (!buf) {
-        fmt::print("malloc failed\n");
+    bool use_cache = _header_cache && !_dump;
+    if (use_cache && load_header_cache()) {
+        return true;
+    }
+
+    uint64_t hdr_offset = SIGNATURE_HEADER_SIZE + _next_hdr_offset;
+    if (!_file.contains(hdr_offset, _next_hdr_size)) {
+        fmt::print("next header out of range\n");
         return false;
     }
 
-    fread(buf, 1, _next_hdr_size, _fp);
-    ByteArray arr(buf, _next_hdr_size, true);
+    ByteArray arr(_file.data() + hdr_offset, _next_hdr_size);
     uint8_t t = arr.read_uint8();
 
     assert(t == Property::ENCODED_HEADER || t == Property::HEADER);
@@ -984,6 +1482,10 @@ bool Archive::read_archive()
             fmt::print("read_encoded_header() failed\n");
             return success;
         }
+        // names of an encrypted header are not written out in the clear
+        if (!_folders.empty() && _folders[0].is_encrypted()) {
+            use_cache = false;
+        }
 
         uint8_t *new_header = decompress_header();
         if (!new_header) {
@@ -1006,12 +1508,18 @@ bool Archive::read_archive()
         reset();
     }
 
-    return read_header(arr);
+    if (!read_header(arr)) {
+        return false;
+    }
+    if (use_cache && !_header_cache_read_only) {
+        save_header_cache();
+    }
+    return true;
 }
 
 bool Archive::read_times(ByteArray &arr, uint32_t num_files, uint8_t t)
 {
-    Bitmap bm(num_files);
+    Bitmap bm(_arena, num_files);
     uint8_t all_defined = arr.read_uint8();
     if (!all_defined) {
         arr.read_bytes(bm._bitset, bm._size);
@@ -1026,25 +1534,28 @@ bool Archive::read_times(ByteArray &arr, uint32_t num_files, uint8_t t)
         return false;
     }
 
+    std::vector<uint64_t> *times;
+    uint8_t flag;
+    switch (t) {
+    case Property::CREATION_TIME:
+        times = &_files._ctime;
+        flag = F_F_CTIME;
+        break;
+    case Property::LAST_ACCESS_TIME:
+        times = &_files._atime;
+        flag = F_F_ATIME;
+        break;
+    default:
+        times = &_files._mtime;
+        flag = F_F_MTIME;
+        break;
+    }
+
+    times->assign(num_files, 0);
     for (uint64_t i = 0; i < num_files; i++) {
         if (bm.test(i)) {
-            uint64_t v = arr.read_uint64();
-            switch (t) {
-            case Property::CREATION_TIME:
-                _files_info[i]._ctime = v;
-                _files_info[i].set_ctime();
-                break;
-            case Property::LAST_ACCESS_TIME:
-                _files_info[i]._atime = v;
-                _files_info[i].set_atime();
-                break;
-            case Property::LAST_WRITE_TIME:
-                _files_info[i]._mtime = v;
-                _files_info[i].set_mtime();
-                break;
-            default:
-                break;
-            }
+            (*times)[i] = arr.read_uint64();
+            _files._flags[i] |= flag;
         }
     }
     return true;
@@ -1052,7 +1563,7 @@ bool Archive::read_times(ByteArray &arr, uint32_t num_files, uint8_t t)
 
 bool Archive::read_attrs(ByteArray& arr, uint32_t num_files)
 {
-    Bitmap bm(num_files);
+    Bitmap bm(_arena, num_files);
     uint8_t all_defined = arr.read_uint8();
     if (!all_defined) {
         arr.read_bytes(bm._bitset, bm._size);
@@ -1069,9 +1580,8 @@ bool Archive::read_attrs(ByteArray& arr, uint32_t num_files)
 
     for (uint64_t i = 0; i < num_files; i++) {
         if (bm.test(i)) {
-            uint32_t v = arr.read_uint32();
-            _files_info[i]._attribute = v;
-            _files_info[i].set_attribute();
+            _files._attribute[i] = arr.read_uint32();
+            _files._flags[i] |= F_F_ATTRIBUTE;
         }
     }
     return true;
@@ -1079,42 +1589,52 @@ bool Archive::read_attrs(ByteArray& arr, uint32_t num_files)
 
 bool Archive::update_files_info()
 {
-    auto it = _files_info.begin();
-    auto end = _files_info.end();
+    auto &f = _files;
+    uint32_t n = f.size();
+    uint32_t k = 0;
     uint32_t num_folders = _folders.size();
 
+    _folder_first_file.resize(num_folders);
     for (uint32_t i = 0; i < num_folders; i++) {
         uint64_t offset = 0;
         auto &u = _substream_sizes[i];
         uint32_t num_substreams = u.size();
+        _folder_first_file[i] = k;
         for (uint32_t j = 0; j < num_substreams; j++) {
-            while (it->is_empty_stream()) {
-                ++it;
+            while (k < n && (f._flags[k] & F_F_EMPTY_STREAM)) {
+                k++;
             }
-            it->_folder = i;
-            it->_size = u[j];
-            it->_offset = offset;
+            if (k == n) {
+                return false;
+            }
+            f._folder[k] = i;
+            f._size[k] = u[j];
+            f._offset[k] = offset;
             offset += u[j];
-            ++it;
+            k++;
         }
         assert(offset == _folders[i].get_unpack_size());
     }
-    assert(it == end);
+    // directories and empty files usually come after the last stream
+    while (k < n && (f._flags[k] & F_F_EMPTY_STREAM)) {
+        k++;
+    }
+    assert(k == n);
 
-    auto crc_it = _substreams_digest._crcs.cbegin();
-    for (it = _files_info.begin(); it != end; ++it) {
-        if (it->is_empty_stream()) {
+    auto crc_it = _substreams_digest._crcs.begin();
+    for (k = 0; k < n; k++) {
+        if (f._flags[k] & F_F_EMPTY_STREAM) {
             continue;
         }
-        it->_crc = *crc_it;
+        f._crc[k] = *crc_it;
         ++crc_it;
     }
-    assert(crc_it == _substreams_digest._crcs.cend());
+    assert(crc_it == _substreams_digest._crcs.end());
 
     return true;
 }
 
-Archive::Archive(const std::string &s, uint32_t flags) : _name(s), _fp(nullptr), _dump(false)
+Archive::Archive(const std::string &s, uint32_t flags) : _name(s), _fp(nullptr), _dump(false), _num_threads(1), _memory_limit(0), _async_io(false), _header_cache(true), _header_cache_read_only(false)
 {
     std::string mode;
 
@@ -1135,17 +1655,17 @@ Archive::Archive(const std::string &s, uint32_t flags) : _name(s), _fp(nullptr),
         _dump = true;
     }
 
-    _fp = fopen(s.c_str(), mode.c_str());
-    if (!_fp) {
-        throw fmt::system_error(errno, "{} ", s.c_str());
-    }
-
     if (flags & A_F_WRITE) {
+        _fp = fopen(s.c_str(), mode.c_str());
+        if (!_fp) {
+            throw fmt::system_error(errno, "{} ", s.c_str());
+        }
         fwrite(MAGIC_AND_VERSION, 1, sizeof(MAGIC_AND_VERSION), _fp);
     } else {
-        uint8_t buf[8];
-        fread(buf, 1, sizeof(buf), _fp);
-        if (!is_valid(buf)) {
+        if (!_file.open(s)) {
+            throw fmt::system_error(errno, "{} ", s.c_str());
+        }
+        if (!_file.contains(0, sizeof(MAGIC_AND_VERSION)) || !is_valid(_file.data())) {
             fmt::print("invalid Signature\n");
             return;
         }
@@ -1154,74 +1674,682 @@ Archive::Archive(const std::string &s, uint32_t flags) : _name(s), _fp(nullptr),
 
 Archive::~Archive()
 {
-    fclose(_fp);
+    if (_fp) {
+        fclose(_fp);
+    }
 }
 
-bool Folder::decompress(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+bool Folder::bind(Arena &arena)
 {
     uint32_t num_coders = _coders.size();
-    const uint8_t *curr_in = in;
-    size_t curr_in_size = in_size;
-    uint8_t *curr_out = nullptr;
-    std::vector<uint8_t *> v;
-    bool err = true;
-
-    for (uint32_t i = 0; i < num_coders; i++) {
-        auto &c = _coders[i];
-        size_t curr_out_size;
-        if (i == num_coders - 1) {
-            curr_out_size = out_size;
-            curr_out = out;
-        } else {
-            curr_out_size = c._unpack_size;
-            curr_out = new uint8_t[curr_out_size];
-            if (!curr_out) {
-                fmt::print("alloc failed with {}\n", curr_out_size);
-                err = false;
+    if (num_coders == 0 || _num_out_streams_total != num_coders) {
+        return false;
+    }
+    // decode_coder() reads the in streams the method takes without checking
+    for (auto &c : _coders) {
+        if (c._num_out_streams != 1 || c._num_in_streams != c.method_in_streams()) {
+            return false;
+        }
+    }
+
+    uint32_t num_packed = _num_in_streams_total - _bind_pairs.size();
+    if (_packed_streams_index.empty() && num_packed == 1) {
+        for (uint32_t i = 0; i < _num_in_streams_total; i++) {
+            if (bound_coder(i) < 0) {
+                _packed_streams_index = arena.alloc_array<uint32_t>(1);
+                _packed_streams_index[0] = i;
                 break;
             }
-            v.push_back(curr_out);
         }
+    }
+    if (_packed_streams_index.size() != num_packed) {
+        return false;
+    }
 
-        if (c.is_lzma()) {
-            int err = IMethod::lzma_decompress(curr_out, &curr_out_size, curr_in, &curr_in_size, c._property, c._property_size);
-            if (err) {
-                fmt::print("lzma_decompress() failed\n");
-                err = false;
-                break;
+    // every in stream is fed once, every out stream but the main one is used once
+    std::vector<uint8_t> in_used(_num_in_streams_total, 0);
+    std::vector<uint8_t> out_used(_num_out_streams_total, 0);
+    for (auto &bp : _bind_pairs) {
+        if (bp.first >= _num_in_streams_total || bp.second >= _num_out_streams_total ||
+            in_used[bp.first]++ || out_used[bp.second]++) {
+            return false;
+        }
+    }
+    for (auto in : _packed_streams_index) {
+        if (in >= _num_in_streams_total || in_used[in]++) {
+            return false;
+        }
+    }
+    _main_coder = std::find(out_used.begin(), out_used.end(), 0) - out_used.begin();
+
+    // all coders hang off the main one, which rules out cycles
+    std::vector<uint32_t> pending(1, _main_coder);
+    uint32_t reached = 0;
+    while (!pending.empty() && reached <= num_coders) {
+        auto &c = _coders[pending.back()];
+        pending.pop_back();
+        reached++;
+        for (uint32_t j = 0; j < c._num_in_streams; j++) {
+            int from = bound_coder(c._start_in_index + j);
+            if (from >= 0) {
+                pending.push_back(from);
             }
+        }
+    }
+    return reached == num_coders;
+}
+
+int Folder::bound_coder(uint32_t in) const
+{
+    for (auto &bp : _bind_pairs) {
+        if (bp.first == in) {
+            // every coder has a single out stream, numbered like the coder
+            return bp.second;
+        }
+    }
+    return -1;
+}
+
+int Folder::packed_index(uint32_t in) const
+{
+    for (uint32_t i = 0; i < _packed_streams_index.size(); i++) {
+        if (_packed_streams_index[i] == in) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool Folder::chain(std::vector<uint32_t> &order) const
+{
+    order.clear();
+    if (num_packed_streams() != 1) {
+        return false;
+    }
+    for (int i = _main_coder; i >= 0; i = bound_coder(_coders[i]._start_in_index)) {
+        if (_coders[i]._num_in_streams != 1) {
+            return false;
+        }
+        order.push_back(i);
+    }
+    std::reverse(order.begin(), order.end());
+    return true;
+}
+
+// branch converters hold back at most 15 bytes of an instruction crossing
+// the end of what they were given, x86_Convert() for one 4 bytes after an
+// E8/E9 opcode and IA64 a whole bundle
+constexpr static size_t FILTER_LOOKAHEAD = 16;
+// between two stages of a coder pipeline, about what a core keeps in L2
+constexpr static size_t PIPELINE_RING_SIZE = 512 << 10;
+// filtering in place and checking the result go through a buffer in steps
+// of this size, so the check finds the data in cache
+constexpr static size_t FILTER_STEP = 256 << 10;
+
+// A filter after a streaming decoder: every chunk is converted as it
+// arrives, the few bytes of an instruction crossing a chunk boundary are
+// held back by branch converters until the next chunk (or the end of the
+// stream)
+struct FilterStage {
+    FilterStage() : filter(IMethod::BRANCH_X86), branch(false), delta(0), pending(0), ip(0), state(0)
+    {
+        ::memset(history, 0, sizeof(history));
+    }
+
+    void init(const Coder &c)
+    {
+        branch = c.is_branch(&filter);
+        delta = c.is_delta() ? c.delta_distance() : 0;
+        ip = c.branch_start();
+    }
+
+    // converts data in place, returns how many leading bytes are final
+    size_t convert(uint8_t *data, size_t size)
+    {
+        if (delta) {
+            IMethod::delta_decode(data, size, delta, history);
+            return size;
+        }
+        if (!branch) {
+            return size;
+        }
+        size_t done = IMethod::branch_decode(filter, data, size, ip, &state);
+        ip += (uint32_t)done;
+        return done;
+    }
+
+    bool push(const uint8_t *data, size_t size, const IMethod::Sink &next)
+    {
+        size_t total = pending + size;
+        if (buf.size() < total) {
+            buf.resize(total);
+        }
+        ::memcpy(buf.data() + pending, data, size);
+
+        size_t done = convert(buf.data(), total);
+        if (done && !next(buf.data(), done)) {
+            return false;
+        }
+        ::memmove(buf.data(), buf.data() + done, total - done);
+        pending = total - done;
+        return true;
+    }
+
+    bool flush(const IMethod::Sink &next)
+    {
+        return pending == 0 || next(buf.data(), pending);
+    }
+
+    IMethod::BranchFilter filter;
+    bool branch;
+    uint32_t delta;                // distance, 0 unless Delta
+    uint8_t history[256];          // the last delta bytes decoded
+    std::vector<uint8_t> buf;
+    size_t pending;
+    uint32_t ip;
+    uint32_t state;
+};
+
+// Copy coder: the packed data is the output. It is handed on in steps so
+// that the next stage finds it in cache, out may be null when nothing needs
+// to keep it.
+static bool copy_stored(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size, const IMethod::Sink &sink)
+{
+    if (in_size < out_size) {
+        fmt::print("stored stream is too short\n");
+        return false;
+    }
+    for (size_t pos = 0; pos < out_size;) {
+        size_t n = std::min(out_size - pos, FILTER_STEP);
+        const uint8_t *p = in + pos;
+        if (out) {
+            ::memcpy(out + pos, p, n);
+            p = out + pos;
+        }
+        if (!sink(p, n)) {
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
+
+// How far another thread has filled a buffer front to back. Readers wait
+// for the part they need until the writer is done, whether it got to the
+// end or not.
+class Watermark {
+public:
+    Watermark() : _filled(0), _done(false) {}
+
+    void advance(size_t n)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _filled += n;
+        _more.notify_all();
+    }
+
+    void done()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _done = true;
+        _more.notify_all();
+    }
+
+    // blocks until more than pos bytes are filled or the writer is done
+    size_t wait(size_t pos)
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _more.wait(guard, [&] {
+            return _done || _filled > pos;
+        });
+        return _filled;
+    }
+
+private:
+    size_t _filled;
+    bool _done;
+    std::mutex _lock;
+    std::condition_variable _more;
+};
+
+static bool check_password()
+{
+    if (!IMethod::has_password()) {
+        fmt::print("encrypted data, give the password with -p\n");
+        return false;
+    }
+    return true;
+}
+
+bool Folder::decode_coder(uint32_t coder, const std::vector<InStream> &packed, uint8_t *out, size_t out_size,
+                          uint32_t num_threads)
+{
+    auto &c = _coders[coder];
+    std::vector<InStream> in(c._num_in_streams);
+    std::vector<PooledBuffer> buffers(c._num_in_streams);
+    std::vector<uint32_t> bound;
+
+    for (uint32_t j = 0; j < c._num_in_streams; j++) {
+        int p = packed_index(c._start_in_index + j);
+        if (p >= 0) {
+            in[j] = packed[p];
+            continue;
+        }
+        size_t size = _coders[bound_coder(c._start_in_index + j)]._unpack_size;
+        if (c.is_filter() && size == out_size) {
+            // filters work in place, their input is decoded right into out
+            in[j] = InStream{out, size};
+            bound.push_back(j);
+            continue;
+        }
+        if (!buffers[j].alloc(size)) {
+            fmt::print("alloc failed with {}\n", size);
+            return false;
+        }
+        in[j] = InStream{buffers[j].data(), size};
+        bound.push_back(j);
+    }
+
+    IMethod::Sink none = [](const uint8_t *, size_t) {
+        return true;
+    };
+
+    // LZMA can't be split up, so the 7zAES coder feeding it decrypts on the
+    // other threads while LZMA reads right behind it
+    int feeder = bound.size() == 1 ? bound_coder(c._start_in_index) : -1;
+    if (c.is_lzma() && num_threads > 1 && feeder >= 0 && _coders[feeder].is_aes() &&
+        packed_index(_coders[feeder]._start_in_index) >= 0) {
+        auto &a = _coders[feeder];
+        const InStream &src = packed[packed_index(a._start_in_index)];
+        if (!check_password()) {
+            return false;
+        }
+
+        Watermark decrypted;
+        std::atomic<bool> stop(false);
+        std::thread t([&] {
+            IMethod::aes_decode((uint8_t *)in[0].data, in[0].size, src.data, src.size, a._property,
+                                a._property_size, num_threads - 1, [&](const uint8_t *, size_t n) {
+                decrypted.advance(n);
+                return !stop;
+            });
+            decrypted.done();
+        });
+        int err = IMethod::lzma_decompress(out, out_size, in[0].data, in[0].size, c._property, c._property_size,
+                                           none, [&](size_t pos) {
+            return decrypted.wait(pos);
+        });
+        stop = true;
+        t.join();
+        if (err) {
+            fmt::print("decompress failed {}\n", err);
+        }
+        return err == 0;
+    }
+
+    // the coders feeding this one don't depend on each other
+    uint32_t num_bound = bound.size();
+    uint32_t threads_each = num_bound && num_threads > num_bound ? num_threads / num_bound : 1;
+    bool success = parallel_for(num_bound, num_threads, [&](uint32_t k) {
+        uint32_t j = bound[k];
+        return decode_coder(bound_coder(c._start_in_index + j), packed, (uint8_t *)in[j].data, in[j].size, threads_each);
+    });
+    if (!success) {
+        return false;
+    }
+
+    int err = 0;
+    if (c.is_lzma()) {
+        size_t out_len = out_size;
+        size_t in_len = in[0].size;
+        err = IMethod::lzma_decompress(out, &out_len, in[0].data, &in_len, c._property, c._property_size);
+        if (!err && out_len != out_size) {
+            fmt::print("lzma stream ended early\n");
+            return false;
+        }
+    } else if (c.is_lzma2()) {
+        err = IMethod::lzma2_decompress_mt(out, out_size, in[0].data, in[0].size, c._property[0], num_threads, none);
+    } else if (c.is_zstd()) {
+        err = IMethod::zstd_decompress_mt(out, out_size, in[0].data, in[0].size, num_threads, none);
+    } else if (c.is_filter()) {
+        if (in[0].size != out_size) {
+            fmt::print("Incorrect filter stream size\n");
+            return false;
+        }
+        if (in[0].data != out) {
+            ::memcpy(out, in[0].data, out_size);
+        }
+        FilterStage st;
+        st.init(c);
+        st.convert(out, out_size);
+    } else if (c.is_aes()) {
+        if (!check_password()) {
+            return false;
+        }
+        err = IMethod::aes_decode(out, out_size, in[0].data, in[0].size, c._property, c._property_size,
+                                  num_threads, none);
+    } else if (c.is_bcj2()) {
+        const uint8_t *src[4] = {in[0].data, in[1].data, in[2].data, in[3].data};
+        size_t src_len[4] = {in[0].size, in[1].size, in[2].size, in[3].size};
+        err = IMethod::bcj2_decode(out, out_size, src, src_len);
+    } else {
+        fmt::print("Unsupported coder\n");
+        return false;
+    }
+    if (err) {
+        fmt::print("decompress failed {}\n", err);
+    }
+    return err == 0;
+}
+
+bool Folder::decompress(const std::vector<InStream> &in, uint8_t *out, size_t out_size,
+                        const std::function<bool(const uint8_t *, size_t)> &progress,
+                        uint32_t num_threads)
+{
+    if (in.size() != num_packed_streams()) {
+        fmt::print("Incorrect number of packed streams\n");
+        return false;
+    }
+
+    // hand every chunk of the final output to progress right after it has
+    // been decoded, while it is still in cache
+    if (progress && can_stream()) {
+        std::vector<uint32_t> order;
+        chain(order);
+        auto &c = _coders[order[0]];
+        uint32_t num_filters = order.size() - 1;
+
+        if (num_filters && (num_threads > 1 || c._unpack_size != out_size)) {
+            // filters run on small chunks, no intermediate buffer is needed.
+            // With threads to spare the coders of the chain run as a pipeline.
+            size_t pos = 0;
+            bool success = decompress_stream(in[0].data, in[0].size, 0, [&](const uint8_t *data, size_t size) {
+                if (size > out_size - pos) {
+                    return false;
+                }
+                ::memcpy(out + pos, data, size);
+                pos += size;
+                return progress(out + pos - size, size);
+            }, out_size, num_threads);
+            return success && pos == out_size;
+        }
+
+        // The decoder keeps reading its output back as dictionary, so the
+        // filters can only convert it in place once it is complete. They
+        // go through it in cache sized steps, each a few bytes behind the
+        // one before it, and every step is handed to progress while hot.
+        // final[i] bytes have been through filter i, final[0] is decoded.
+        std::vector<size_t> final(num_filters + 1, 0);
+        std::vector<FilterStage> stages(num_filters);
+        for (uint32_t i = 0; i < num_filters; i++) {
+            stages[i].init(_coders[order[i + 1]]);
+        }
+        size_t passed = 0;
+        auto convert = [&](bool end) {
+            for (uint32_t i = 1; i <= num_filters; i++) {
+                final[i] += stages[i - 1].convert(out + final[i], final[i - 1] - final[i]);
+                if (end) {
+                    final[i] = final[i - 1];
+                }
+            }
+            size_t n = final[num_filters] - passed;
+            passed += n;
+            return n == 0 || progress(out + passed - n, n);
+        };
+
+        IMethod::Sink none = [](const uint8_t *, size_t) {
+            return true;
+        };
+        const IMethod::Sink &sink = num_filters ? none : progress;
+        int err = 0;
+        if (c.is_copy()) {
+            if (!copy_stored(in[0].data, in[0].size, out, out_size, sink)) {
+                return false;
+            }
+        } else if (c.is_lzma()) {
+            err = IMethod::lzma_decompress(out, out_size, in[0].data, in[0].size, c._property, c._property_size, sink);
         } else if (c.is_lzma2()) {
-            int err = IMethod::lzma2_decompress(curr_out, &curr_out_size, curr_in, &curr_in_size, c._property[0]);
-            if (err) {
-                fmt::print("lzma2_decompress() failed\n");
-                err = false;
-                break;
+            err = IMethod::lzma2_decompress_mt(out, out_size, in[0].data, in[0].size, c._property[0], num_threads, sink);
+        } else {
+            err = IMethod::zstd_decompress_mt(out, out_size, in[0].data, in[0].size, num_threads, sink);
+        }
+        if (err) {
+            fmt::print("decompress failed {}\n", err);
+            return false;
+        }
+
+        while (num_filters && final[0] < out_size) {
+            final[0] += std::min(out_size - final[0], FILTER_STEP);
+            if (!convert(final[0] == out_size)) {
+                return false;
             }
+        }
+        return true;
+    }
+
+    if (out_size != get_unpack_size()) {
+        return false;
+    }
+    bool success = decode_coder(_main_coder, in, out, out_size, num_threads);
+    if (success && progress) {
+        success = progress(out, out_size);
+    }
+    return success;
+}
+
+bool Folder::can_stream() const
+{
+    std::vector<uint32_t> order;
+    if (!chain(order)) {
+        return false;
+    }
+
+    auto &c = _coders[order[0]];
+    if (!c.is_lzma() && !c.is_lzma2() && !c.is_zstd() && !c.is_copy()) {
+        return false;
+    }
+    for (size_t i = 1; i < order.size(); i++) {
+        if (!_coders[order[i]].is_filter()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Folder::decompress_stream(const uint8_t *in, size_t in_size, size_t window_size,
+                               const std::function<bool(const uint8_t *, size_t)> &sink,
+                               uint64_t limit, uint32_t num_threads)
+{
+    std::vector<uint32_t> order;
+    if (!chain(order)) {
+        return false;
+    }
+    uint32_t num_stages = order.size() - 1;
+    std::vector<FilterStage> stages(num_stages);
+    for (uint32_t i = 0; i < num_stages; i++) {
+        stages[i].init(_coders[order[i + 1]]);
+    }
+
+    // an instruction starting right before the limit is converted from the
+    // bytes after it, so every filter needs a few more decoded bytes
+    auto &c = _coders[order[0]];
+    uint64_t total = get_unpack_size();
+    if (limit > total) {
+        limit = total;
+    }
+    uint64_t decoded = limit + (uint64_t)num_stages * FILTER_LOOKAHEAD;
+    if (decoded > c._unpack_size) {
+        decoded = c._unpack_size;
+    }
+
+    uint64_t passed = 0;
+    IMethod::Sink limited = [&](const uint8_t *data, size_t size) {
+        if (passed >= limit) {
+            return true;
+        }
+        size_t n = size < limit - passed ? size : (size_t)(limit - passed);
+        passed += n;
+        return sink(data, n);
+    };
+
+    auto decode = [&](const IMethod::Sink &out) {
+        int err;
+        if (c.is_copy()) {
+            return copy_stored(in, in_size, nullptr, decoded, out);
+        } else if (c.is_lzma()) {
+            err = IMethod::lzma_decompress_stream(decoded, window_size, in, in_size, c._property, c._property_size, out);
+        } else if (c.is_lzma2()) {
+            err = IMethod::lzma2_decompress_stream(decoded, window_size, in, in_size, c._property[0], out);
         } else if (c.is_zstd()) {
-            int err = IMethod::zstd_decompress(curr_out, curr_out_size, curr_in, curr_in_size);
-            if (err) {
-                fmt::print("zstd_decompress() failed\n");
-                err = false;
-                break;
-            }
-        } else if (c.is_bcj()) {
-            assert(curr_in_size == curr_out_size);
-            ::memcpy(curr_out, curr_in, curr_in_size);
-            IMethod::bcj_decode(curr_out, curr_out_size);
+            err = IMethod::zstd_decompress_stream(decoded, in, in_size, out);
         } else {
             fmt::print("Unsupported coder\n");
-            err = false;
+            return false;
+        }
+        if (err) {
+            fmt::print("streaming decompress failed {}\n", err);
+        }
+        return err == 0;
+    };
+
+    if (num_stages == 0 || num_threads < 2) {
+        // sinks[i] receives the output of coder i
+        std::vector<IMethod::Sink> sinks(num_stages + 1);
+        sinks[num_stages] = limited;
+        for (uint32_t i = num_stages; i > 0; i--) {
+            FilterStage *st = &stages[i - 1];
+            const IMethod::Sink *next = &sinks[i];
+            sinks[i - 1] = [st, next](const uint8_t *data, size_t size) {
+                return st->push(data, size, *next);
+            };
+        }
+
+        if (!decode(sinks[0])) {
+            return false;
+        }
+        for (uint32_t i = 0; i < num_stages; i++) {
+            if (!stages[i].flush(sinks[i + 1])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Pipeline: the decoder and every filter run on threads of their own,
+    // rings[i] holds the output of coder i and the calling thread feeds the
+    // last one to sink. No stage waits for the whole output of the one
+    // before it.
+    std::vector<std::unique_ptr<RingBuffer>> rings;
+    for (uint32_t i = 0; i <= num_stages; i++) {
+        rings.emplace_back(new RingBuffer(PIPELINE_RING_SIZE));
+    }
+    auto abort_all = [&rings]() {
+        for (auto &r : rings) {
+            r->abort();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.emplace_back([&]() {
+        bool success = decode([&rings](const uint8_t *data, size_t size) {
+            return rings[0]->write(data, size);
+        });
+        if (success) {
+            rings[0]->close();
+        } else {
+            abort_all();
+        }
+    });
+    for (uint32_t i = 0; i < num_stages; i++) {
+        threads.emplace_back([&, i]() {
+            RingBuffer &from = *rings[i];
+            RingBuffer &to = *rings[i + 1];
+            IMethod::Sink next = [&to](const uint8_t *data, size_t size) {
+                return to.write(data, size);
+            };
+
+            const uint8_t *data;
+            size_t n;
+            while ((n = from.read(data)) != 0) {
+                if (!stages[i].push(data, n, next)) {
+                    abort_all();
+                    return;
+                }
+                from.consume(n);
+            }
+            if (from.aborted() || !stages[i].flush(next)) {
+                abort_all();
+                return;
+            }
+            to.close();
+        });
+    }
+
+    bool success = true;
+    RingBuffer &last = *rings[num_stages];
+    const uint8_t *data;
+    size_t n;
+    while ((n = last.read(data)) != 0) {
+        if (!limited(data, n)) {
+            success = false;
+            abort_all();
             break;
         }
+        last.consume(n);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    return success && !last.aborted();
+}
+
+bool Folder::can_checkpoint() const
+{
+    return _coders.size() == 1 && (_coders[0].is_lzma() || _coders[0].is_lzma2());
+}
+
+bool Folder::checkpoints(const uint8_t *in, size_t in_size, size_t interval,
+                         const std::function<bool(const IMethod::Checkpoint &)> &save)
+{
+    auto &c = _coders[0];
+    int err;
+    if (c.is_lzma()) {
+        err = IMethod::lzma_checkpoints(get_unpack_size(), in, in_size, c._property, c._property_size, interval, save);
+    } else {
+        err = IMethod::lzma2_checkpoints(get_unpack_size(), in, in_size, c._property[0], interval, save);
+    }
+    if (err) {
+        fmt::print("building checkpoints failed {}\n", err);
+    }
+    return err == 0;
+}
+
+bool Folder::resume(const uint8_t *in, size_t in_size, const IMethod::Checkpoint &cp,
+                    uint8_t *out, size_t out_size)
+{
+    IMethod::Sink none = [](const uint8_t *, size_t) {
+        return true;
+    };
 
-        curr_in_size = curr_out_size;
-        curr_in = curr_out;
+    // the start of the folder needs no checkpoint
+    if (cp.unpack_offset == 0) {
+        return decompress(in, in_size, out, out_size, none);
+    }
+    if (cp.unpack_offset > get_unpack_size() || out_size > get_unpack_size() - cp.unpack_offset) {
+        return false;
     }
 
-    for (auto p : v) {
-        delete[] p;
+    auto &c = _coders[0];
+    int err;
+    if (c.is_lzma()) {
+        err = IMethod::lzma_resume(cp, out, out_size, in, in_size, c._property, c._property_size, none);
+    } else {
+        err = IMethod::lzma2_resume(cp, out, out_size, in, in_size, c._property[0], none);
+    }
+    if (err) {
+        fmt::print("resuming from checkpoint failed {}\n", err);
     }
-    return err;
+    return err == 0;
 }
 
 }
@@ -1,12 +1,18 @@
 #pragma once
 
 #include "stdc++.h"
+#include "mapped_file.h"
+#include "index.h"
+#include "arena.h"
+#include "buffer_pool.h"
 
 // Reference: https://py7zr.readthedocs.io/en/latest/archive_format.html
 
 namespace I7Zip {
 
 uint32_t crc32(const void *buf, uint32_t size);
+// continue a crc32 over more data, crc32_update(0, ...) starts a new one
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size);
 
 constexpr uint8_t MAX_NUM_CODERS = 64;
 constexpr uint8_t MAX_NUM_ADDITIONAL_STREAMS = 8;
@@ -226,30 +232,20 @@ private:
 
 class Bitmap {
 public:
-    Bitmap() : _bitset(nullptr) {};
+    Bitmap() : _number(0), _size(0), _bitset(nullptr) {};
 
-    Bitmap(uint32_t number)
+    Bitmap(Arena &arena, uint32_t number)
     {
-        init(number);
+        init(arena, number);
     };
 
-    ~Bitmap()
-    {
-        if (_bitset) {
-            delete[] _bitset;
-        }
-    }
-
-    bool init(uint32_t number)
+    bool init(Arena &arena, uint32_t number)
     {
         uint32_t sz = number / 8;
         if (number % 8) {
             sz++;
         }
-        _bitset = new uint8_t[sz];
-        if (!_bitset) {
-            return false;
-        }
+        _bitset = arena.alloc_array<uint8_t>(sz).data();
 
         _number = number;
         _size = sz;
@@ -285,12 +281,10 @@ public:
         }
     }
 
+    // the storage goes back with the arena
     void reset()
     {
-        if (_bitset) {
-            delete[] _bitset;
-        }
-
+        _bitset = nullptr;
         _number = 0;
         _size = 0;
     }
@@ -302,18 +296,15 @@ public:
 
 class BitmapDigest {
 public:
-    BitmapDigest() : _bitset(nullptr) {}
+    BitmapDigest() : _all_defined(0), _number(0), _size(0), _bitset(nullptr) {}
 
-    bool init(uint8_t all_defined, uint32_t number)
+    bool init(Arena &arena, uint8_t all_defined, uint32_t number)
     {
         uint32_t sz = number / 8;
         if (number % 8) {
             sz++;
         }
-        _bitset = new uint8_t[sz];
-        if (!_bitset) {
-            return false;
-        }
+        _bitset = arena.alloc_array<uint8_t>(sz).data();
 
         _all_defined = all_defined;
         if (all_defined == 1) {
@@ -324,19 +315,12 @@ public:
             }
         }
 
-        _crcs.resize(number);
+        _crcs = arena.alloc_array<uint32_t>(number);
         _number = number;
         _size = sz;
         return true;
     }
 
-    ~BitmapDigest()
-    {
-        if (_bitset) {
-            delete[] _bitset;
-        }
-    }
-
     void set(uint32_t i)
     {
         _bitset[i / 8] |= (1U << (7 - (i % 8)));
@@ -352,24 +336,21 @@ public:
         return (_bitset[i / 8] & (1U << (7 - (i % 8)))) != 0;
     }
 
+    // the storage goes back with the arena
     void reset()
     {
-        if (_bitset) {
-            delete[] _bitset;
-        }
-
         _bitset = nullptr;
         _all_defined = 0;
         _number = 0;
         _size = 0;
-        _crcs.clear();
+        _crcs = ArenaArray<uint32_t>();
     }
 
     uint8_t _all_defined;
     uint32_t _number;
     uint32_t _size;
     uint8_t *_bitset;
-    std::vector<uint32_t> _crcs;
+    ArenaArray<uint32_t> _crcs;
 };
 
 class Coder {
@@ -382,20 +363,13 @@ public:
     uint16_t _start_out_index;
     uint64_t _unpack_size;
     uint32_t _property_size;
-    uint8_t *_property;
+    uint8_t *_property; // owned by the archive's arena
 
-    Coder():_property(nullptr)
+    Coder():_property_size(0), _property(nullptr)
     {
         ::memset(_id, 0, sizeof(_id));
     }
 
-    ~Coder()
-    {
-        if (_property) {
-            delete _property;
-        }
-    }
-
     size_t id_size() const
     {
         return (size_t)(_flag & 0xF);
@@ -416,157 +390,412 @@ public:
         return _flag & 0x80;
     }
 
+    // method IDs differ in length, Delta's is a prefix of LZMA's
+    bool has_id(const uint8_t *id, size_t size) const
+    {
+        return id_size() == size && ::memcmp(_id, id, size) == 0;
+    }
+
     bool is_lzma() const
     {
         const uint8_t lzma_id[] = {0x3, 0x1, 0x1};
-        return ::memcmp(_id, lzma_id, id_size()) == 0;
+        return has_id(lzma_id, sizeof(lzma_id));
     }
 
     bool is_lzma2() const
     {
         const uint8_t lzma_id[] = {0x21};
-        return ::memcmp(_id, lzma_id, id_size()) == 0;
+        return has_id(lzma_id, sizeof(lzma_id));
     }
 
     bool is_zstd() const
     {
         const uint8_t zstd_id[] = {0x04, 0xf7, 0x11, 0x01};
-        return ::memcmp(_id, zstd_id, id_size()) == 0;
+        return has_id(zstd_id, sizeof(zstd_id));
     }
 
-    bool is_bcj() const
+    // BCJ2 takes four in streams, every other method one
+    uint32_t method_in_streams() const
     {
-        const uint8_t bcj_id[] = {0x03, 0x03, 0x01, 0x03};
-        return ::memcmp(_id, bcj_id, id_size()) == 0 && _num_in_streams == 1;
+        const uint8_t bcj2_id[] = {0x03, 0x03, 0x01, 0x1b};
+        return has_id(bcj2_id, sizeof(bcj2_id)) ? 4 : 1;
     }
 
     bool is_bcj2() const
     {
-        const uint8_t bcj2_id[] = {0x03, 0x03, 0x01, 0x1b};
-        return ::memcmp(_id, bcj2_id, id_size()) == 0 && _num_in_streams == 4;
+        return method_in_streams() == 4 && _num_in_streams == 4;
+    }
+
+    bool is_aes() const
+    {
+        const uint8_t aes_id[] = {0x06, 0xf1, 0x07, 0x01};
+        return has_id(aes_id, sizeof(aes_id)) && _num_in_streams == 1;
+    }
+
+    // stored data
+    bool is_copy() const
+    {
+        const uint8_t copy_id[] = {0x00};
+        return has_id(copy_id, sizeof(copy_id)) && _num_in_streams == 1;
     }
+
+    bool is_delta() const
+    {
+        const uint8_t delta_id[] = {0x03};
+        return has_id(delta_id, sizeof(delta_id)) && _num_in_streams == 1 && _property_size == 1;
+    }
+
+    // distance in bytes between the values Delta subtracts, 1 to 256
+    uint32_t delta_distance() const
+    {
+        return (uint32_t)_property[0] + 1;
+    }
+
+    // BCJ and the branch converters for other architectures
+    bool is_branch(IMethod::BranchFilter *filter = nullptr) const
+    {
+        static const struct {
+            uint8_t size;
+            uint8_t id[4];
+            IMethod::BranchFilter filter;
+        } filters[] = {
+            {4, {0x03, 0x03, 0x01, 0x03}, IMethod::BRANCH_X86},
+            {4, {0x03, 0x03, 0x02, 0x05}, IMethod::BRANCH_PPC},
+            {4, {0x03, 0x03, 0x04, 0x01}, IMethod::BRANCH_IA64},
+            {4, {0x03, 0x03, 0x05, 0x01}, IMethod::BRANCH_ARM},
+            {4, {0x03, 0x03, 0x07, 0x01}, IMethod::BRANCH_ARMT},
+            {4, {0x03, 0x03, 0x08, 0x05}, IMethod::BRANCH_SPARC},
+            {1, {0x0a}, IMethod::BRANCH_ARM64},
+        };
+
+        if (_num_in_streams != 1) {
+            return false;
+        }
+        for (auto &f : filters) {
+            if (has_id(f.id, f.size)) {
+                if (filter) {
+                    *filter = f.filter;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // stream position of the first byte for a branch converter, may be set
+    // by a 4 byte property
+    uint32_t branch_start() const
+    {
+        if (_property_size != 4) {
+            return 0;
+        }
+        return (uint32_t)_property[0] | ((uint32_t)_property[1] << 8) | ((uint32_t)_property[2] << 16) |
+               ((uint32_t)_property[3] << 24);
+    }
+
+    // coders of one input that keep the size and can work in place
+    bool is_filter() const
+    {
+        return is_branch() || is_delta() || is_copy();
+    }
+};
+
+// A packed stream of a folder, or the output of a coder bound to an input
+// of another one
+struct InStream {
+    const uint8_t *data;
+    size_t size;
 };
 
+// Coders of a folder form a tree: every input stream of a coder is either
+// read from a packed stream or bound by a bind pair to the output of another
+// coder, and the output no bind pair refers to is the folder's output.
 class Folder {
 public:
-    std::vector<Coder> _coders;
+    // storage of the arrays belongs to the archive's arena
+    ArenaArray<Coder> _coders;
     uint16_t _num_in_streams_total;
     uint16_t _num_out_streams_total;
-    std::vector<std::pair<uint8_t, uint8_t>> _bind_pairs;
-    std::vector<uint32_t> _packed_streams_index;
+    ArenaArray<std::pair<uint8_t, uint8_t>> _bind_pairs; // (in stream, out stream)
+    ArenaArray<uint32_t> _packed_streams_index;          // in stream of every packed stream
     uint32_t _start_packed_stream_index;
+    uint32_t _main_coder;                                // produces the folder's output
 
-    Folder() : _num_in_streams_total(0), _num_out_streams_total(0) {};
+    Folder() : _num_in_streams_total(0), _num_out_streams_total(0), _start_packed_stream_index(0), _main_coder(0) {};
+
+    // Check that the coders form a tree and find its root. The packed stream
+    // of single stream folders is implied by the header, it is filled in here.
+    bool bind(Arena &arena);
 
     uint64_t get_unpack_size()
     {
-        return _coders.back()._unpack_size;
+        return _coders[_main_coder]._unpack_size;
+    }
+
+    uint32_t num_packed_streams() const
+    {
+        return (uint32_t)_packed_streams_index.size();
+    }
+
+    // a single Copy coder, the packed stream is the folder's data
+    bool is_stored() const
+    {
+        return _coders.size() == 1 && _coders[0].is_copy();
+    }
+
+    // some coder is 7zAES, decoding needs the password
+    bool is_encrypted() const
+    {
+        for (auto &c : _coders) {
+            if (c.is_aes()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // in is every packed stream of the folder in header order. progress,
+    // when given, receives the decoded output in order; for streamable coder
+    // chains it is called chunk by chunk during decoding. num_threads is a
+    // hint for coders able to split their own stream and for the coders
+    // feeding a coder of several inputs, which are decoded side by side.
+    // Streamable chains may be asked for less than get_unpack_size() bytes,
+    // decoding then stops once out_size bytes are produced.
+    bool decompress(const std::vector<InStream> &in, uint8_t *out, size_t out_size,
+                    const std::function<bool(const uint8_t *, size_t)> &progress = nullptr,
+                    uint32_t num_threads = 1);
+
+    bool decompress(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size,
+                    const std::function<bool(const uint8_t *, size_t)> &progress = nullptr,
+                    uint32_t num_threads = 1)
+    {
+        return decompress(std::vector<InStream>{{in, in_size}}, out, out_size, progress, num_threads);
+    }
+
+    // Decode through a bounded window instead of a whole-folder buffer, the
+    // output is passed to sink in order as soon as it is decoded. Decoding
+    // stops after the first limit bytes of the folder. With num_threads > 1
+    // the decoder and its filters run on threads of their own, joined by
+    // ring buffers, and sink is called on the calling thread.
+    bool can_stream() const;
+    bool decompress_stream(const uint8_t *in, size_t in_size, size_t window_size,
+                           const std::function<bool(const uint8_t *, size_t)> &sink,
+                           uint64_t limit = UINT64_MAX, uint32_t num_threads = 1);
+
+    // Folders of a single LZMA or LZMA2 coder can be resumed from decoder
+    // checkpoints saved by one full pass (interval 0 picks a default).
+    bool can_checkpoint() const;
+    bool checkpoints(const uint8_t *in, size_t in_size, size_t interval,
+                     const std::function<bool(const IMethod::Checkpoint &)> &save);
+    // decode out_size bytes of the folder from cp.unpack_offset on
+    bool resume(const uint8_t *in, size_t in_size, const IMethod::Checkpoint &cp,
+                uint8_t *out, size_t out_size);
+
+private:
+    // the coder whose output is bound to in stream `in`, -1 for packed streams
+    int bound_coder(uint32_t in) const;
+    // position of in stream `in` among the packed streams, -1 for bound ones
+    int packed_index(uint32_t in) const;
+    // the coders from the packed stream to the output when every coder has
+    // a single input
+    bool chain(std::vector<uint32_t> &order) const;
+    // decode the output of coder into out, its bound inputs first
+    bool decode_coder(uint32_t coder, const std::vector<InStream> &packed, uint8_t *out, size_t out_size,
+                      uint32_t num_threads);
+};
+
+class FileInfo;
+
+// The file table of an archive as parallel arrays, so a pass over one
+// property of all files touches only that property. Names are kept as read
+// from the header, NUL terminated UTF-16 strings back to back in one pool,
+// with their UTF-8 forms in a second pool. ctime and atime are rarely
+// stored and their arrays stay empty unless the header has them.
+class FileTable {
+public:
+    uint32_t size() const
+    {
+        return (uint32_t)_flags.size();
+    }
+
+    void resize(uint32_t n)
+    {
+        _size.assign(n, 0);
+        _offset.assign(n, 0);
+        _crc.assign(n, 0);
+        _folder.assign(n, 0);
+        _attribute.assign(n, 0);
+        _flags.assign(n, 0);
+        _mtime.assign(n, 0);
+        _ctime.clear();
+        _atime.clear();
+        _names.clear();
+        _name_offset.assign(n + 1, 0);
+        _utf8_names.clear();
+        _utf8_offset.assign(n + 1, 0);
     }
 
-    bool decompress(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size);
+    void clear()
+    {
+        resize(0);
+    }
+
+    FileInfo operator[](uint32_t i) const;
+
+    std::vector<uint64_t> _size;
+    std::vector<uint64_t> _offset;          // in the unpacked folder
+    std::vector<uint32_t> _crc;
+    std::vector<uint32_t> _folder;
+    std::vector<uint32_t> _attribute;
+    std::vector<uint8_t> _flags;            // F_F_*
+    std::vector<uint64_t> _mtime;
+    std::vector<uint64_t> _ctime;
+    std::vector<uint64_t> _atime;
+
+    // name i is [_name_offset[i], _name_offset[i + 1]) including its NUL,
+    // the same goes for the UTF-8 names
+    std::vector<uint16_t> _names;
+    std::vector<uint32_t> _name_offset;
+    std::string _utf8_names;
+    std::vector<uint32_t> _utf8_offset;
 };
 
+// A file of a FileTable, small enough to be passed by value
 class FileInfo {
 public:
-    FileInfo() : _mtime(0), _ctime(0), _atime(0), _attribute(0), _flags(0), _size(0), _crc(0) {};
+    FileInfo(const FileTable *table, uint32_t index) : _table(table), _index(index) {}
 
-    bool is_readonly() const
+    uint32_t index() const
     {
-        return (_attribute & 0x1) != 0;
+        return _index;
     }
 
-    bool is_hidden() const
+    const uint16_t *name() const
     {
-        return (_attribute & 0x2) != 0;
+        return _table->_names.data() + _table->_name_offset[_index];
     }
 
-    bool is_system() const
+    const char *utf8_name() const
     {
-        return (_attribute & 0x4) != 0;
+        return _table->_utf8_names.data() + _table->_utf8_offset[_index];
     }
 
-    bool is_directory() const
+    // without the NUL
+    size_t utf8_size() const
     {
-        return (_attribute & 0x10) != 0;
+        return _table->_utf8_offset[_index + 1] - _table->_utf8_offset[_index] - 1;
     }
 
-    bool is_archive() const
+    uint64_t size() const
     {
-        return (_attribute & 0x20) != 0;
+        return _table->_size[_index];
     }
 
-    bool is_empty_stream() const
+    uint64_t offset() const
     {
-        return (_flags & F_F_EMPTY_STREAM) != 0;
+        return _table->_offset[_index];
     }
 
-    bool is_empty_file() const
+    uint32_t crc() const
     {
-        return (_flags & F_F_EMPTY_FILE) != 0;
+        return _table->_crc[_index];
     }
 
-    bool has_attribute() const
+    uint32_t folder() const
     {
-        return (_flags & F_F_ATTRIBUTE) != 0;
+        return _table->_folder[_index];
     }
 
-    bool has_mtime() const
+    uint32_t attribute() const
     {
-        return (_flags & F_F_MTIME) != 0;
+        return _table->_attribute[_index];
     }
 
-    bool has_ctime() const
+    uint64_t mtime() const
     {
-        return (_flags & F_F_CTIME) != 0;
+        return _table->_mtime[_index];
     }
 
-    bool has_atime() const
+    uint64_t ctime() const
     {
-        return (_flags & F_F_ATIME) != 0;
+        return has_ctime() ? _table->_ctime[_index] : 0;
     }
 
-    void set_empty_stream()
+    uint64_t atime() const
     {
-        _flags |= F_F_EMPTY_STREAM;
+        return has_atime() ? _table->_atime[_index] : 0;
     }
 
-    void set_empty_file()
+    bool is_readonly() const
+    {
+        return (attribute() & 0x1) != 0;
+    }
+
+    bool is_hidden() const
+    {
+        return (attribute() & 0x2) != 0;
+    }
+
+    bool is_system() const
+    {
+        return (attribute() & 0x4) != 0;
+    }
+
+    bool is_directory() const
     {
-        _flags |= F_F_EMPTY_FILE;
+        return (attribute() & 0x10) != 0;
     }
 
-    void set_attribute()
+    bool is_archive() const
     {
-        _flags |= F_F_ATTRIBUTE;
+        return (attribute() & 0x20) != 0;
     }
 
-    void set_mtime()
+    bool is_empty_stream() const
     {
-        _flags |= F_F_MTIME;
+        return (flags() & F_F_EMPTY_STREAM) != 0;
     }
 
-    void set_ctime()
+    bool is_empty_file() const
     {
-        _flags |= F_F_CTIME;
+        return (flags() & F_F_EMPTY_FILE) != 0;
     }
 
-    void set_atime()
+    bool has_attribute() const
     {
-        _flags |= F_F_ATIME;
+        return (flags() & F_F_ATTRIBUTE) != 0;
     }
 
-    std::vector<uint16_t> _name;
-    uint64_t _mtime;
-    uint64_t _ctime;
-    uint64_t _atime;
-    uint64_t _size;
-    uint32_t _attribute;
-    uint32_t _flags;
-    uint32_t _crc;
-    uint16_t _folder;
-    uint64_t _offset;
+    bool has_mtime() const
+    {
+        return (flags() & F_F_MTIME) != 0;
+    }
+
+    bool has_ctime() const
+    {
+        return (flags() & F_F_CTIME) != 0;
+    }
+
+    bool has_atime() const
+    {
+        return (flags() & F_F_ATIME) != 0;
+    }
+
+private:
+    uint32_t flags() const
+    {
+        return _table->_flags[_index];
+    }
+
+    const FileTable *_table;
+    uint32_t _index;
 };
 
+inline FileInfo FileTable::operator[](uint32_t i) const
+{
+    return FileInfo(this, i);
+}
+
 class Archive {
 public:
     Archive(const std::string &s, uint32_t flag = 0);
@@ -583,11 +812,71 @@ public:
 
     void ExtractAll();
 
-    bool ExtractFile(std::vector<std::string> &patterns);
+    bool ExtractFile(const std::vector<std::string> &patterns);
 
     void ListFiles();
 
-    void TestArchive();
+    // Decode every folder in memory, side by side, and check the packed
+    // streams, the folders and every file against their CRCs. Nothing is
+    // written. Prints the throughput and the first failure.
+    bool TestArchive();
+
+    // Only read the packed streams and check them against their CRCs,
+    // nothing is decoded. Finds damage to the archive file at disk speed.
+    bool QuickTest();
+
+    // Decode every folder in memory on one thread and print the speed, to
+    // compare builds of the decoders
+    void Benchmark();
+
+    // Decode every LZMA and LZMA2 folder once and save decoder checkpoints
+    // to index_name(archive), for random access to single files later on.
+    bool BuildIndex(size_t interval = 0);
+
+    // use the index of the archive if there is one built for it
+    bool load_index();
+
+    // Decode file index into data and check its crc. With an index loaded
+    // only the part of its folder after the closest checkpoint is decoded.
+    bool ReadFile(uint32_t index, std::vector<uint8_t> &data);
+
+    const FileTable &files() const
+    {
+        return _files;
+    }
+
+    void set_num_threads(uint32_t n)
+    {
+        _num_threads = n ? n : 1;
+    }
+
+    // folders larger than this are decoded through a window of this size
+    // (but at least the dictionary size), 0 decodes every folder in memory
+    void set_memory_limit(uint64_t bytes)
+    {
+        _memory_limit = bytes;
+    }
+
+    // keep the parsed header of large archives in a cache file next to them
+    // and open them from there while they stay unchanged; set before
+    // read_archive()
+    void set_header_cache(bool enable)
+    {
+        _header_cache = enable;
+    }
+
+    // use an existing header cache but never write one, for commands that
+    // leave the archive's directory untouched; set before read_archive()
+    void set_header_cache_read_only(bool enable)
+    {
+        _header_cache_read_only = enable;
+    }
+
+    // write extracted files through io_uring where the system supports it
+    void set_async_io(bool enable)
+    {
+        _async_io = enable;
+    }
 
 private:
     bool write_signature();
@@ -599,6 +888,8 @@ private:
     bool read_sub_streams_info(ByteArray &obj);
     bool read_streams_info(ByteArray& obj);
     bool read_files_info(ByteArray& obj);
+    bool read_names(ByteArray &obj, uint32_t num_files, uint64_t size);
+    void make_utf8_names();
     bool read_times(ByteArray& obj, uint32_t num_files, uint8_t t);
     bool read_attrs(ByteArray& obj, uint32_t num_files);
     bool update_files_info();
@@ -620,17 +911,39 @@ private:
         //return read_streams_info(obj);
     }
 
+    bool load_header_cache();
+    void save_header_cache();
+
     uint8_t *decompress_header();
-    uint8_t *decompress_folder(uint32_t index);
+    // single stream folders only
+    const uint8_t *packed_stream(uint32_t index, size_t &size);
+    bool packed_streams(uint32_t index, std::vector<InStream> &streams);
+    PooledBuffer decompress_folder(uint32_t index, std::vector<uint32_t> &crcs, uint32_t num_threads = 1,
+                                   uint64_t limit = UINT64_MAX);
+    bool extract_folder(uint32_t index);
+    // files of stored folders go from the mapping to the output directly
+    bool extract_stored(uint32_t index);
+    bool write_stored(uint32_t index, const FileInfo &info);
+    bool extract_folder_stream(uint32_t index, uint32_t num_threads);
+    bool extract_indexed(uint32_t index, const std::vector<uint32_t> &files);
+    // first_digest is the index of the folder's first substream CRC, error
+    // says what failed
+    bool test_folder(uint32_t index, uint32_t num_threads, uint32_t first_digest, std::string &error);
 
     void reset();
 
-    void write_decompressed_header(uint8_t *buf, size_t buf_len);
+    void write_decompressed_header(const uint8_t *buf, size_t buf_len);
 
     // common member
     std::string _name;
     FILE *_fp;
+    MappedFile _file;
     bool _dump;
+    uint32_t _num_threads;
+    uint64_t _memory_limit;
+    bool _async_io;
+    bool _header_cache;
+    bool _header_cache_read_only;
 
     // signature header
     uint32_t _start_hdr_crc;
@@ -641,6 +954,7 @@ private:
     // pack info
     uint64_t _pack_pos;
     std::vector<uint64_t> _pack_size;
+    std::vector<uint64_t> _pack_offset;
     BitmapDigest _pack_digest;
 
     // coder info
@@ -652,7 +966,14 @@ private:
     BitmapDigest _substreams_digest;
 
     // files info
-    std::vector<FileInfo> _files_info;
+    FileTable _files;
+    std::vector<uint32_t> _folder_first_file;
+
+    CheckpointIndex _index;
+
+    // coders, bind pairs, bitmaps and digests parsed from the header, released
+    // all at once by reset()
+    Arena _arena;
 };
 
 };
@@ -0,0 +1,564 @@
+#include "method.h"
+#include "parallel.h"
+#include "7zTypes.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define AES_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AES_TARGET(x)
+#else
+#include <cpuid.h>
+#define AES_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+namespace IMethod {
+
+// 7zAES is AES-256 in CBC mode. The key is SHA-256 over 2^n repetitions of
+// salt, password (UTF-16LE) and a 64 bit round counter, n is at most 24.
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, unsigned n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void sha256_blocks_scalar(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    for (; blocks; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K256[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef AES_X86
+
+// SHA extensions keep the state as ABEF and CDGH and do two rounds per
+// instruction, four message words at a time
+AES_TARGET("sha,sse4.1")
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; blocks; blocks--, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+        for (int i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), bswap);
+        }
+
+        for (int g = 0; g < 16; g++) {
+            __m128i &cur = w[g & 3];
+            __m128i &next = w[(g + 1) & 3];
+            __m128i &prev = w[(g + 3) & 3];
+
+            __m128i msg = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i *)&K256[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            if (g >= 3 && g < 15) {
+                next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4));
+                next = _mm_sha256msg2_epu32(next, cur);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+            if (g >= 1 && g < 13) {
+                prev = _mm_sha256msg1_epu32(prev, cur);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static void cpuid(uint32_t leaf, uint32_t sub, uint32_t r[4])
+{
+#ifdef _MSC_VER
+    __cpuidex((int *)r, (int)leaf, (int)sub);
+#else
+    __cpuid_count(leaf, sub, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+static bool has_aesni()
+{
+    uint32_t r[4];
+    cpuid(1, 0, r);
+    return (r[2] & (1U << 25)) != 0;
+}
+
+static bool has_shani()
+{
+    uint32_t r[4];
+    cpuid(0, 0, r);
+    if (r[0] < 7) {
+        return false;
+    }
+    cpuid(1, 0, r);
+    bool sse41 = (r[2] & (1U << 19)) != 0;
+    cpuid(7, 0, r);
+    return sse41 && (r[1] & (1U << 29)) != 0;
+}
+
+#endif
+
+typedef void (*sha256_func)(uint32_t *, const uint8_t *, size_t);
+
+static sha256_func select_sha256()
+{
+#ifdef AES_X86
+    return has_shani() ? sha256_blocks_shani : sha256_blocks_scalar;
+#else
+    return sha256_blocks_scalar;
+#endif
+}
+
+// The rounds form one chain of hashes, so there is nothing to spread over
+// threads or vector lanes. Rounds are laid out back to back, 64 at a time,
+// which always fills whole blocks, and only the counters are rewritten.
+static void derive_key(const uint8_t *salt, size_t salt_size, const std::string &password, unsigned cycles,
+                       uint8_t key[32])
+{
+    if (cycles == 0x3F) {
+        size_t n = 0;
+        ::memset(key, 0, 32);
+        for (size_t i = 0; i < salt_size && n < 32; i++) {
+            key[n++] = salt[i];
+        }
+        for (size_t i = 0; i < password.size() && n < 32; i++) {
+            key[n++] = (uint8_t)password[i];
+        }
+        return;
+    }
+
+    static const sha256_func blocks = select_sha256();
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    const size_t batch = 64;
+    size_t unit = salt_size + password.size() + 8;
+    std::vector<uint8_t> buf(batch * unit + 128);
+    for (size_t k = 0; k < batch; k++) {
+        uint8_t *p = buf.data() + k * unit;
+        ::memcpy(p, salt, salt_size);
+        ::memcpy(p + salt_size, password.data(), password.size());
+    }
+
+    uint64_t rounds = (uint64_t)1 << cycles;
+    uint64_t counter = 0;
+    size_t tail = 0;
+    while (counter < rounds) {
+        size_t n = (size_t)std::min<uint64_t>(batch, rounds - counter);
+        for (size_t k = 0; k < n; k++, counter++) {
+            uint8_t *p = buf.data() + k * unit + unit - 8;
+            for (int j = 0; j < 8; j++) {
+                p[j] = (uint8_t)(counter >> (8 * j));
+            }
+        }
+        size_t len = n * unit;
+        blocks(state, buf.data(), len / 64);
+        // only the last batch can be short of a whole block
+        tail = len % 64;
+        ::memmove(buf.data(), buf.data() + len - tail, tail);
+    }
+
+    uint64_t bits = rounds * unit * 8;
+    uint8_t *p = buf.data();
+    p[tail++] = 0x80;
+    size_t end = tail <= 56 ? 64 : 128;
+    ::memset(p + tail, 0, end - tail);
+    for (int j = 0; j < 8; j++) {
+        p[end - 1 - j] = (uint8_t)(bits >> (8 * j));
+    }
+    blocks(state, p, end / 64);
+
+    for (int i = 0; i < 8; i++) {
+        key[4 * i] = (uint8_t)(state[i] >> 24);
+        key[4 * i + 1] = (uint8_t)(state[i] >> 16);
+        key[4 * i + 2] = (uint8_t)(state[i] >> 8);
+        key[4 * i + 3] = (uint8_t)state[i];
+    }
+}
+
+static std::mutex password_lock;
+static std::string password_utf16;
+static bool password_set = false;
+
+// Every encrypted folder of an archive normally has the same salt and
+// rounds, so the key is derived once. Deriving holds the lock: the other
+// threads want that very key and have nothing better to do than wait.
+static std::mutex key_lock;
+static std::map<std::string, std::array<uint8_t, 32>> key_cache;
+
+static void cached_key(const uint8_t *salt, size_t salt_size, unsigned cycles, uint8_t key[32])
+{
+    std::string password;
+    {
+        std::lock_guard<std::mutex> guard(password_lock);
+        password = password_utf16;
+    }
+
+    std::string id(1, (char)cycles);
+    id.append((const char *)salt, salt_size);
+    id.append(password);
+
+    std::lock_guard<std::mutex> guard(key_lock);
+    auto it = key_cache.find(id);
+    if (it == key_cache.end()) {
+        std::array<uint8_t, 32> k;
+        derive_key(salt, salt_size, password, cycles, k.data());
+        it = key_cache.emplace(id, k).first;
+    }
+    ::memcpy(key, it->second.data(), 32);
+}
+
+void set_password(const std::string &password)
+{
+    // UTF-8 to UTF-16LE, like the names in the header
+    std::string utf16;
+    for (size_t i = 0; i < password.size();) {
+        uint8_t c = (uint8_t)password[i];
+        uint32_t cp = c;
+        size_t n = c < 0x80 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+        if (n) {
+            cp = c & (0x3F >> n);
+        }
+        for (i++; n && i < password.size(); n--, i++) {
+            cp = (cp << 6) | ((uint8_t)password[i] & 0x3F);
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            uint32_t hi = 0xD800 + (cp >> 10);
+            utf16 += (char)(hi & 0xFF);
+            utf16 += (char)(hi >> 8);
+            cp = 0xDC00 + (cp & 0x3FF);
+        }
+        utf16 += (char)(cp & 0xFF);
+        utf16 += (char)((cp >> 8) & 0xFF);
+    }
+
+    std::lock_guard<std::mutex> guard(password_lock);
+    password_utf16 = utf16;
+    password_set = true;
+}
+
+bool has_password()
+{
+    std::lock_guard<std::mutex> guard(password_lock);
+    return password_set;
+}
+
+struct AesTables {
+    uint8_t sbox[256];
+    uint8_t inv[256];
+    uint8_t mul9[256], mul11[256], mul13[256], mul14[256];
+
+    static uint8_t xtime(uint8_t x)
+    {
+        return (uint8_t)((x << 1) ^ (x & 0x80 ? 0x1B : 0));
+    }
+
+    static uint8_t mul(uint8_t a, uint8_t b)
+    {
+        uint8_t p = 0;
+        for (; b; b >>= 1, a = xtime(a)) {
+            if (b & 1) {
+                p ^= a;
+            }
+        }
+        return p;
+    }
+
+    AesTables()
+    {
+        // walk the multiplicative group with generator 3 and its inverse
+        uint8_t p = 1, q = 1;
+        do {
+            p = (uint8_t)(p ^ xtime(p));
+            q ^= (uint8_t)(q << 1);
+            q ^= (uint8_t)(q << 2);
+            q ^= (uint8_t)(q << 4);
+            if (q & 0x80) {
+                q ^= 0x09;
+            }
+            uint8_t x = q;
+            for (int r = 1; r < 5; r++) {
+                x ^= (uint8_t)((q << r) | (q >> (8 - r)));
+            }
+            sbox[p] = x ^ 0x63;
+        } while (p != 1);
+        sbox[0] = 0x63;
+
+        for (int i = 0; i < 256; i++) {
+            inv[sbox[i]] = (uint8_t)i;
+            mul9[i] = mul((uint8_t)i, 9);
+            mul11[i] = mul((uint8_t)i, 11);
+            mul13[i] = mul((uint8_t)i, 13);
+            mul14[i] = mul((uint8_t)i, 14);
+        }
+    }
+};
+
+static const AesTables &aes_tables()
+{
+    static const AesTables t;
+    return t;
+}
+
+// 15 round keys of 16 bytes
+static void aes256_expand(const uint8_t key[32], uint8_t rk[240])
+{
+    const uint8_t *s = aes_tables().sbox;
+    uint8_t rcon = 1;
+
+    ::memcpy(rk, key, 32);
+    for (size_t i = 32; i < 240; i += 4) {
+        uint8_t t[4] = {rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1]};
+        if (i % 32 == 0) {
+            uint8_t x = t[0];
+            t[0] = s[t[1]] ^ rcon;
+            t[1] = s[t[2]];
+            t[2] = s[t[3]];
+            t[3] = s[x];
+            rcon = AesTables::xtime(rcon);
+        } else if (i % 32 == 16) {
+            for (int j = 0; j < 4; j++) {
+                t[j] = s[t[j]];
+            }
+        }
+        for (int j = 0; j < 4; j++) {
+            rk[i + j] = rk[i - 32 + j] ^ t[j];
+        }
+    }
+}
+
+static void aes256_decrypt_block(const uint8_t rk[240], const uint8_t in[16], uint8_t out[16])
+{
+    const AesTables &T = aes_tables();
+    uint8_t s[16];
+    for (int i = 0; i < 16; i++) {
+        s[i] = in[i] ^ rk[224 + i];
+    }
+
+    for (int r = 13; r >= 0; r--) {
+        // byte row + 4 * column; rows turn right, then the inverse S-box
+        uint8_t t[16];
+        for (int c = 0; c < 4; c++) {
+            for (int row = 0; row < 4; row++) {
+                t[row + 4 * c] = T.inv[s[row + 4 * ((c - row + 4) & 3)]] ^ rk[16 * r + row + 4 * c];
+            }
+        }
+        if (r == 0) {
+            ::memcpy(out, t, 16);
+            return;
+        }
+        for (int c = 0; c < 4; c++) {
+            const uint8_t *a = t + 4 * c;
+            s[4 * c] = T.mul14[a[0]] ^ T.mul11[a[1]] ^ T.mul13[a[2]] ^ T.mul9[a[3]];
+            s[4 * c + 1] = T.mul9[a[0]] ^ T.mul14[a[1]] ^ T.mul11[a[2]] ^ T.mul13[a[3]];
+            s[4 * c + 2] = T.mul13[a[0]] ^ T.mul9[a[1]] ^ T.mul14[a[2]] ^ T.mul11[a[3]];
+            s[4 * c + 3] = T.mul11[a[0]] ^ T.mul13[a[1]] ^ T.mul9[a[2]] ^ T.mul14[a[3]];
+        }
+    }
+}
+
+static void cbc_decrypt_scalar(const uint8_t rk[240], const uint8_t iv[16], const uint8_t *src, uint8_t *dest,
+                               size_t blocks)
+{
+    uint8_t prev[16];
+    ::memcpy(prev, iv, 16);
+    for (; blocks; blocks--, src += 16, dest += 16) {
+        uint8_t c[16], p[16];
+        ::memcpy(c, src, 16);
+        aes256_decrypt_block(rk, c, p);
+        for (int i = 0; i < 16; i++) {
+            dest[i] = p[i] ^ prev[i];
+        }
+        ::memcpy(prev, c, 16);
+    }
+}
+
+#ifdef AES_X86
+
+// CBC decryption has no chain, eight blocks go through the rounds side by
+// side to hide the latency of aesdec
+AES_TARGET("aes,sse2")
+static void cbc_decrypt_aesni(const uint8_t rk[240], const uint8_t iv[16], const uint8_t *src, uint8_t *dest,
+                              size_t blocks)
+{
+    __m128i k[15];
+    k[0] = _mm_loadu_si128((const __m128i *)(rk + 224));
+    for (int r = 1; r < 14; r++) {
+        k[r] = _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)(rk + 16 * (14 - r))));
+    }
+    k[14] = _mm_loadu_si128((const __m128i *)rk);
+
+    __m128i prev = _mm_loadu_si128((const __m128i *)iv);
+    for (; blocks >= 8; blocks -= 8, src += 128, dest += 128) {
+        __m128i c[8], x[8];
+        for (int j = 0; j < 8; j++) {
+            c[j] = _mm_loadu_si128((const __m128i *)(src + 16 * j));
+            x[j] = _mm_xor_si128(c[j], k[0]);
+        }
+        for (int r = 1; r < 14; r++) {
+            for (int j = 0; j < 8; j++) {
+                x[j] = _mm_aesdec_si128(x[j], k[r]);
+            }
+        }
+        for (int j = 0; j < 8; j++) {
+            x[j] = _mm_aesdeclast_si128(x[j], k[14]);
+        }
+        _mm_storeu_si128((__m128i *)dest, _mm_xor_si128(x[0], prev));
+        for (int j = 1; j < 8; j++) {
+            _mm_storeu_si128((__m128i *)(dest + 16 * j), _mm_xor_si128(x[j], c[j - 1]));
+        }
+        prev = c[7];
+    }
+    for (; blocks; blocks--, src += 16, dest += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)src);
+        __m128i x = _mm_xor_si128(c, k[0]);
+        for (int r = 1; r < 14; r++) {
+            x = _mm_aesdec_si128(x, k[r]);
+        }
+        x = _mm_aesdeclast_si128(x, k[14]);
+        _mm_storeu_si128((__m128i *)dest, _mm_xor_si128(x, prev));
+        prev = c;
+    }
+}
+
+#endif
+
+typedef void (*cbc_func)(const uint8_t *, const uint8_t *, const uint8_t *, uint8_t *, size_t);
+
+static cbc_func select_cbc_decrypt()
+{
+#ifdef AES_X86
+    return has_aesni() ? cbc_decrypt_aesni : cbc_decrypt_scalar;
+#else
+    return cbc_decrypt_scalar;
+#endif
+}
+
+// the previous ciphertext block is all a chunk needs, so chunks are
+// decrypted independently
+constexpr static size_t AES_CHUNK = (size_t)1 << 20;
+
+int aes_decode(unsigned char *dest, size_t destLen,
+               const unsigned char *src, size_t srcLen,
+               const unsigned char *props, size_t propsSize,
+               uint32_t numThreads, const Sink &sink)
+{
+    // cycles in the low 6 bits, then the sizes of salt and IV of up to 16
+    if (propsSize < 1) {
+        return SZ_ERROR_UNSUPPORTED;
+    }
+    unsigned cycles = props[0] & 0x3F;
+    size_t salt_size = 0, iv_size = 0;
+    if (props[0] & 0xC0) {
+        if (propsSize < 2) {
+            return SZ_ERROR_UNSUPPORTED;
+        }
+        salt_size = ((props[0] >> 7) & 1) + (props[1] >> 4);
+        iv_size = ((props[0] >> 6) & 1) + (props[1] & 0x0F);
+        if (propsSize != 2 + salt_size + iv_size) {
+            return SZ_ERROR_UNSUPPORTED;
+        }
+    } else if (propsSize != 1) {
+        return SZ_ERROR_UNSUPPORTED;
+    }
+    if (cycles > 24 && cycles != 0x3F) {
+        return SZ_ERROR_UNSUPPORTED;
+    }
+    if (!has_password()) {
+        return SZ_ERROR_PARAM;
+    }
+    // the encoder pads the last block
+    if (srcLen < ((destLen + 15) & ~(size_t)15)) {
+        return SZ_ERROR_INPUT_EOF;
+    }
+
+    uint8_t iv[16] = {0};
+    ::memcpy(iv, props + 2 + salt_size, iv_size);
+    uint8_t key[32];
+    cached_key(props + 2, salt_size, cycles, key);
+    uint8_t rk[240];
+    aes256_expand(key, rk);
+
+    static const cbc_func cbc = select_cbc_decrypt();
+    uint32_t n = (uint32_t)((destLen + AES_CHUNK - 1) / AES_CHUNK);
+    bool success = I7Zip::parallel_for_ordered(n, numThreads, [&](uint32_t i) {
+        size_t start = (size_t)i * AES_CHUNK;
+        size_t len = std::min(AES_CHUNK, destLen - start);
+        const uint8_t *chunk_iv = i ? src + start - 16 : iv;
+        cbc(rk, chunk_iv, src + start, dest + start, len / 16);
+        if (len % 16) {
+            size_t last = start + len - len % 16;
+            uint8_t block[16];
+            cbc(rk, last ? src + last - 16 : iv, src + last, block, 1);
+            ::memcpy(dest + last, block, len % 16);
+        }
+        return true;
+    }, [&](uint32_t i) {
+        size_t start = (size_t)i * AES_CHUNK;
+        return sink(dest + start, std::min(AES_CHUNK, destLen - start));
+    });
+    return success ? SZ_OK : SZ_ERROR_PROGRESS;
+}
+
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "stdc++.h"
+
+namespace I7Zip {
+
+// A fixed size array whose storage belongs to an Arena
+template <typename T>
+class ArenaArray {
+public:
+    ArenaArray() : _data(nullptr), _size(0) {}
+    ArenaArray(T *data, size_t size) : _data(data), _size(size) {}
+
+    T *data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    T &operator[](size_t i) const
+    {
+        return _data[i];
+    }
+
+    T &back() const
+    {
+        return _data[_size - 1];
+    }
+
+    T *begin() const
+    {
+        return _data;
+    }
+
+    T *end() const
+    {
+        return _data + _size;
+    }
+
+private:
+    T *_data;
+    size_t _size;
+};
+
+// Bump allocator for everything parsed out of an archive header. Storage is
+// carved from large blocks and only given back all at once by release(), so
+// objects allocated here are never destroyed one by one. Not thread safe.
+class Arena {
+public:
+    Arena() : _pos(nullptr), _end(nullptr) {}
+    Arena(const Arena &p) = delete;
+    Arena & operator=(const Arena &p) = delete;
+
+    ~Arena()
+    {
+        release();
+    }
+
+    void *alloc(size_t size, size_t align = alignof(std::max_align_t))
+    {
+        uintptr_t p = ((uintptr_t)_pos + align - 1) & ~(uintptr_t)(align - 1);
+        if (!_pos || size > (uintptr_t)_end - p) {
+            return alloc_slow(size, align);
+        }
+        _pos = (uint8_t *)(p + size);
+        return (void *)p;
+    }
+
+    // n value-initialized objects
+    template <typename T>
+    ArenaArray<T> alloc_array(size_t n)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        if (n == 0) {
+            return ArenaArray<T>();
+        }
+        T *p = (T *)alloc(n * sizeof(T), alignof(T));
+        for (size_t i = 0; i < n; i++) {
+            new (p + i) T();
+        }
+        return ArenaArray<T>(p, n);
+    }
+
+    void release()
+    {
+        for (auto b : _blocks) {
+            delete[] b;
+        }
+        _blocks.clear();
+        _pos = nullptr;
+        _end = nullptr;
+    }
+
+private:
+    constexpr static size_t BLOCK_SIZE = (size_t)64 << 10;
+
+    void *alloc_slow(size_t size, size_t align)
+    {
+        // large arrays get a block of their own, the current block stays in use
+        if (size > BLOCK_SIZE / 4) {
+            uint8_t *b = new uint8_t[size + align];
+            _blocks.push_back(b);
+            return (void *)(((uintptr_t)b + align - 1) & ~(uintptr_t)(align - 1));
+        }
+
+        uint8_t *b = new uint8_t[BLOCK_SIZE];
+        _blocks.push_back(b);
+        _pos = b;
+        _end = b + BLOCK_SIZE;
+        return alloc(size, align);
+    }
+
+    std::vector<uint8_t *> _blocks;
+    uint8_t *_pos;
+    uint8_t *_end;
+};
+
+};
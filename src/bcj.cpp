@@ -0,0 +1,454 @@
+#include "method.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BCJ_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BCJ_TARGET(x)
+#define BCJ_INLINE __forceinline
+#else
+#define BCJ_TARGET(x) __attribute__((target(x)))
+#define BCJ_INLINE inline __attribute__((always_inline))
+#endif
+#else
+#define BCJ_INLINE inline
+#endif
+
+namespace IMethod {
+
+// Branch converters, they turn the absolute addresses the encoder stored in
+// call and jump instructions back into relative ones.
+
+// x86_Convert() of Bra86.c for decoding, with the search for the next E8/E9
+// opcode done by find. Almost all of the time goes into that search, the
+// conversion itself is the same as the LZMA SDK's.
+template <typename Find>
+static BCJ_INLINE size_t x86_decode(uint8_t *data, size_t size, uint32_t ip, uint32_t *state, Find find)
+{
+    // the most significant byte of a near call or jump offset is 00 or FF
+    auto ms_byte = [](uint8_t b) {
+        return ((b + 1) & 0xFE) == 0;
+    };
+
+    size_t pos = 0;
+    uint32_t mask = *state & 7;
+    if (size < 5) {
+        return 0;
+    }
+    size -= 4;
+    ip += 5;
+    const uint8_t *limit = data + size;
+
+    for (;;) {
+        uint8_t *p = (uint8_t *)find(data + pos, limit);
+        size_t d = (size_t)(p - data) - pos;
+        pos = (size_t)(p - data);
+        if (p >= limit) {
+            *state = d > 2 ? 0 : mask >> (unsigned)d;
+            return pos;
+        }
+        if (d > 2) {
+            mask = 0;
+        } else {
+            mask >>= (unsigned)d;
+            if (mask != 0 && (mask > 4 || mask == 3 || ms_byte(p[(size_t)(mask >> 1) + 1]))) {
+                mask = (mask >> 1) | 4;
+                pos++;
+                continue;
+            }
+        }
+
+        if (ms_byte(p[4])) {
+            uint32_t v = ((uint32_t)p[4] << 24) | ((uint32_t)p[3] << 16) | ((uint32_t)p[2] << 8) | p[1];
+            uint32_t cur = ip + (uint32_t)pos;
+            pos += 5;
+            v -= cur;
+            if (mask != 0) {
+                unsigned sh = (mask & 6) << 2;
+                if (ms_byte((uint8_t)(v >> sh))) {
+                    v ^= ((uint32_t)0x100 << sh) - 1;
+                    v -= cur;
+                }
+                mask = 0;
+            }
+            p[1] = (uint8_t)v;
+            p[2] = (uint8_t)(v >> 8);
+            p[3] = (uint8_t)(v >> 16);
+            p[4] = (uint8_t)(0 - ((v >> 24) & 1));
+        } else {
+            mask = (mask >> 1) | 4;
+            pos++;
+        }
+    }
+}
+
+static BCJ_INLINE const uint8_t *find_opcode_scalar(const uint8_t *p, const uint8_t *limit)
+{
+    for (; p < limit; p++) {
+        if ((*p & 0xFE) == 0xE8) {
+            break;
+        }
+    }
+    return p;
+}
+
+#ifndef BCJ_X86
+
+static size_t x86_decode_scalar(uint8_t *data, size_t size, uint32_t ip, uint32_t *state)
+{
+    return x86_decode(data, size, ip, state, find_opcode_scalar);
+}
+
+#else
+
+static BCJ_INLINE unsigned lowest_bit(uint32_t m)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, m);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(m);
+#endif
+}
+
+// SSE2 is part of x86-64, 16 candidates per compare
+static BCJ_INLINE const uint8_t *find_opcode_sse2(const uint8_t *p, const uint8_t *limit)
+{
+    const __m128i fe = _mm_set1_epi8((char)0xFE);
+    const __m128i e8 = _mm_set1_epi8((char)0xE8);
+    for (; limit - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, fe), e8));
+        if (m) {
+            return p + lowest_bit(m);
+        }
+    }
+    return find_opcode_scalar(p, limit);
+}
+
+static size_t x86_decode_sse2(uint8_t *data, size_t size, uint32_t ip, uint32_t *state)
+{
+    return x86_decode(data, size, ip, state, find_opcode_sse2);
+}
+
+BCJ_TARGET("avx2")
+static BCJ_INLINE const uint8_t *find_opcode_avx2(const uint8_t *p, const uint8_t *limit)
+{
+    const __m256i fe = _mm256_set1_epi8((char)0xFE);
+    const __m256i e8 = _mm256_set1_epi8((char)0xE8);
+    for (; limit - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, fe), e8));
+        if (m) {
+            return p + lowest_bit(m);
+        }
+    }
+    return find_opcode_sse2(p, limit);
+}
+
+BCJ_TARGET("avx2")
+static size_t x86_decode_avx2(uint8_t *data, size_t size, uint32_t ip, uint32_t *state)
+{
+    return x86_decode(data, size, ip, state, find_opcode_avx2);
+}
+
+static bool has_avx2()
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 1);
+    // AVX and the OS saving ymm state
+    if (!(r[2] & (1 << 27)) || !(r[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static BCJ_INLINE uint32_t get_ui32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static BCJ_INLINE void set_ui32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+// Filters of 4 byte instructions. An instruction read as little endian is a
+// candidate when (v & MASK1) == VALUE1 or (v & MASK2) == VALUE2, convert()
+// decodes a candidate at stream position pc in place. The conversions are
+// those of xz and 7-Zip.
+
+// BL
+struct ArmFilter {
+    static constexpr uint32_t MASK1 = 0xFF000000, VALUE1 = 0xEB000000;
+    static constexpr uint32_t MASK2 = MASK1, VALUE2 = VALUE1;
+
+    static BCJ_INLINE void convert(uint8_t *p, uint32_t pc)
+    {
+        uint32_t src = ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+        uint32_t dest = ((src << 2) - (pc + 8)) >> 2;
+        p[2] = (uint8_t)(dest >> 16);
+        p[1] = (uint8_t)(dest >> 8);
+        p[0] = (uint8_t)dest;
+    }
+};
+
+// BL and ADRP
+struct Arm64Filter {
+    static constexpr uint32_t MASK1 = 0xFC000000, VALUE1 = 0x94000000;
+    static constexpr uint32_t MASK2 = 0x9F000000, VALUE2 = 0x90000000;
+
+    static BCJ_INLINE void convert(uint8_t *p, uint32_t pc)
+    {
+        uint32_t v = get_ui32(p);
+        if ((v & MASK1) == VALUE1) {
+            set_ui32(p, VALUE1 | ((v - (pc >> 2)) & 0x03FFFFFF));
+            return;
+        }
+
+        // only pages within +-512 MiB are converted
+        uint32_t src = ((v >> 29) & 3) | ((v >> 3) & 0x001FFFFC);
+        if ((src + 0x00020000) & 0x001C0000) {
+            return;
+        }
+        uint32_t dest = src - (pc >> 12);
+        v &= 0x9000001F;
+        v |= (dest & 3) << 29;
+        v |= (dest & 0x0003FFFC) << 3;
+        v |= (0U - (dest & 0x00020000)) & 0x00E00000;
+        set_ui32(p, v);
+    }
+};
+
+// big endian bl
+struct PpcFilter {
+    static constexpr uint32_t MASK1 = 0x030000FC, VALUE1 = 0x01000048;
+    static constexpr uint32_t MASK2 = MASK1, VALUE2 = VALUE1;
+
+    static BCJ_INLINE void convert(uint8_t *p, uint32_t pc)
+    {
+        uint32_t src = ((uint32_t)(p[0] & 3) << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (p[3] & ~3U);
+        uint32_t dest = src - pc;
+        p[0] = (uint8_t)(0x48 | ((dest >> 24) & 3));
+        p[1] = (uint8_t)(dest >> 16);
+        p[2] = (uint8_t)(dest >> 8);
+        p[3] = (uint8_t)((p[3] & 3) | (dest & ~3U));
+    }
+};
+
+// big endian call with a displacement of at most +-8 MiB
+struct SparcFilter {
+    static constexpr uint32_t MASK1 = 0xC0FF, VALUE1 = 0x0040;
+    static constexpr uint32_t MASK2 = 0xC0FF, VALUE2 = 0xC07F;
+
+    static BCJ_INLINE void convert(uint8_t *p, uint32_t pc)
+    {
+        uint32_t src = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        uint32_t dest = ((src << 2) - pc) >> 2;
+        dest = (((0 - ((dest >> 22) & 1)) << 22) & 0x3FFFFFFF) | (dest & 0x3FFFFF) | 0x40000000;
+        p[0] = (uint8_t)(dest >> 24);
+        p[1] = (uint8_t)(dest >> 16);
+        p[2] = (uint8_t)(dest >> 8);
+        p[3] = (uint8_t)dest;
+    }
+};
+
+template <typename F>
+static BCJ_INLINE bool is_candidate(uint32_t v)
+{
+    return (v & F::MASK1) == F::VALUE1 || (v & F::MASK2) == F::VALUE2;
+}
+
+template <typename F>
+static size_t aligned_decode_scalar(uint8_t *data, size_t size, uint32_t ip)
+{
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        if (is_candidate<F>(get_ui32(data + i))) {
+            F::convert(data + i, ip + (uint32_t)i);
+        }
+    }
+    return i;
+}
+
+#ifdef BCJ_X86
+
+// every lane is tested before any of them is converted, a conversion only
+// changes its own instruction
+template <typename F>
+static size_t aligned_decode_sse2(uint8_t *data, size_t size, uint32_t ip)
+{
+    const __m128i m1 = _mm_set1_epi32((int)F::MASK1);
+    const __m128i v1 = _mm_set1_epi32((int)F::VALUE1);
+    const __m128i m2 = _mm_set1_epi32((int)F::MASK2);
+    const __m128i v2 = _mm_set1_epi32((int)F::VALUE2);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(v, m1), v1), _mm_cmpeq_epi32(_mm_and_si128(v, m2), v2));
+        uint32_t m = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(hit));
+        for (; m; m &= m - 1) {
+            size_t k = i + 4 * lowest_bit(m);
+            F::convert(data + k, ip + (uint32_t)k);
+        }
+    }
+    return i + aligned_decode_scalar<F>(data + i, size - i, ip + (uint32_t)i);
+}
+
+template <typename F>
+BCJ_TARGET("avx2")
+static size_t aligned_decode_avx2(uint8_t *data, size_t size, uint32_t ip)
+{
+    const __m256i m1 = _mm256_set1_epi32((int)F::MASK1);
+    const __m256i v1 = _mm256_set1_epi32((int)F::VALUE1);
+    const __m256i m2 = _mm256_set1_epi32((int)F::MASK2);
+    const __m256i v2 = _mm256_set1_epi32((int)F::VALUE2);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_and_si256(v, m1), v1),
+                                      _mm256_cmpeq_epi32(_mm256_and_si256(v, m2), v2));
+        uint32_t m = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(hit));
+        for (; m; m &= m - 1) {
+            size_t k = i + 4 * lowest_bit(m);
+            F::convert(data + k, ip + (uint32_t)k);
+        }
+    }
+    return i + aligned_decode_sse2<F>(data + i, size - i, ip + (uint32_t)i);
+}
+
+#endif
+
+template <typename F>
+static size_t aligned_decode(uint8_t *data, size_t size, uint32_t ip)
+{
+#ifdef BCJ_X86
+    static const bool avx2 = has_avx2();
+    return avx2 ? aligned_decode_avx2<F>(data, size, ip) : aligned_decode_sse2<F>(data, size, ip);
+#else
+    return aligned_decode_scalar<F>(data, size, ip);
+#endif
+}
+
+// Thumb BL, a pair of 2 byte halves on any 2 byte boundary
+static size_t armt_decode(uint8_t *data, size_t size, uint32_t ip)
+{
+    size_t i = 0;
+    for (; i + 4 <= size; i += 2) {
+        if ((data[i + 1] & 0xF8) != 0xF0 || (data[i + 3] & 0xF8) != 0xF8) {
+            continue;
+        }
+        uint32_t src = ((uint32_t)(data[i + 1] & 7) << 19) | ((uint32_t)data[i] << 11) |
+                       ((uint32_t)(data[i + 3] & 7) << 8) | data[i + 2];
+        uint32_t dest = ((src << 1) - (ip + (uint32_t)i + 4)) >> 1;
+        data[i + 1] = (uint8_t)(0xF0 | ((dest >> 19) & 7));
+        data[i] = (uint8_t)(dest >> 11);
+        data[i + 3] = (uint8_t)(0xF8 | ((dest >> 8) & 7));
+        data[i + 2] = (uint8_t)dest;
+        i += 2;
+    }
+    return i;
+}
+
+// 16 byte bundles of three 41 bit slots, the template in the low 5 bits
+// tells which slots may hold a branch
+static size_t ia64_decode(uint8_t *data, size_t size, uint32_t ip)
+{
+    static const uint8_t branch_slots[32] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        4, 4, 6, 6, 0, 0, 7, 7, 4, 4, 0, 0, 4, 4, 0, 0
+    };
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        uint32_t mask = branch_slots[data[i] & 0x1F];
+        uint32_t bit_pos = 5;
+        for (uint32_t slot = 0; slot < 3; slot++, bit_pos += 41) {
+            if (((mask >> slot) & 1) == 0) {
+                continue;
+            }
+            uint8_t *p = data + i + (bit_pos >> 3);
+            uint32_t bit_res = bit_pos & 7;
+            uint64_t instruction = 0;
+            for (uint32_t j = 0; j < 6; j++) {
+                instruction |= (uint64_t)p[j] << (8 * j);
+            }
+
+            uint64_t norm = instruction >> bit_res;
+            if (((norm >> 37) & 0xF) != 0x5 || ((norm >> 9) & 0x7) != 0) {
+                continue;
+            }
+            uint32_t src = (uint32_t)((norm >> 13) & 0xFFFFF);
+            src |= (uint32_t)((norm >> 36) & 1) << 20;
+            uint32_t dest = ((src << 4) - (ip + (uint32_t)i)) >> 4;
+            norm &= ~((uint64_t)0x8FFFFF << 13);
+            norm |= (uint64_t)(dest & 0xFFFFF) << 13;
+            norm |= (uint64_t)(dest & 0x100000) << (36 - 20);
+            instruction &= ((uint64_t)1 << bit_res) - 1;
+            instruction |= norm << bit_res;
+            for (uint32_t j = 0; j < 6; j++) {
+                p[j] = (uint8_t)(instruction >> (8 * j));
+            }
+        }
+    }
+    return i;
+}
+
+typedef size_t (*x86_decode_func)(uint8_t *, size_t, uint32_t, uint32_t *);
+
+static x86_decode_func select_x86_decode()
+{
+#ifdef BCJ_X86
+    return has_avx2() ? x86_decode_avx2 : x86_decode_sse2;
+#else
+    return x86_decode_scalar;
+#endif
+}
+
+size_t bcj_decode(unsigned char *data, size_t size, uint32_t ip, uint32_t *state)
+{
+    static const x86_decode_func f = select_x86_decode();
+    return f(data, size, ip, state);
+}
+
+size_t branch_decode(BranchFilter filter, unsigned char *data, size_t size, uint32_t ip, uint32_t *state)
+{
+    switch (filter) {
+    case BRANCH_X86:
+        return bcj_decode(data, size, ip, state);
+    case BRANCH_PPC:
+        return aligned_decode<PpcFilter>(data, size, ip);
+    case BRANCH_IA64:
+        return ia64_decode(data, size, ip);
+    case BRANCH_ARM:
+        return aligned_decode<ArmFilter>(data, size, ip);
+    case BRANCH_ARMT:
+        return armt_decode(data, size, ip);
+    case BRANCH_SPARC:
+        return aligned_decode<SparcFilter>(data, size, ip);
+    case BRANCH_ARM64:
+        return aligned_decode<Arm64Filter>(data, size, ip);
+    }
+    return 0;
+}
+
+size_t bcj_decode(unsigned char *data, size_t size)
+{
+    uint32_t state = 0;
+    return bcj_decode(data, size, 0, &state);
+}
+
+};
@@ -0,0 +1,161 @@
+#include "buffer_pool.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace I7Zip {
+
+// smaller buffers are left to the allocator, its own caches handle them well
+constexpr static size_t POOL_MIN_SIZE = 64 << 10;
+// four classes per power of two, less than a quarter of a buffer goes unused
+constexpr static size_t CLASS_STEPS = 4;
+constexpr static size_t HUGE_PAGE_SIZE = 2 << 20;
+// released buffers beyond this are given back to the system
+constexpr static size_t POOL_MAX_CACHED = (size_t)512 << 20;
+
+static std::atomic<bool> explicit_huge_pages(false);
+
+struct Pool {
+    std::mutex lock;
+    std::map<size_t, std::vector<uint8_t *>> free_lists;
+    size_t cached = 0;
+
+    ~Pool();
+};
+
+static Pool &pool()
+{
+    static Pool p;
+    return p;
+}
+
+static size_t class_size(size_t size)
+{
+    size_t pow = POOL_MIN_SIZE;
+    while (pow < size && pow <= SIZE_MAX / 2) {
+        pow *= 2;
+    }
+    size_t step = pow / 2 / CLASS_STEPS;
+    size_t n = (size + step - 1) / step * step;
+    // whole huge pages, also what munmap() of a hugetlb mapping expects
+    if (n >= HUGE_PAGE_SIZE) {
+        n = (n + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+    return n;
+}
+
+#ifdef __linux__
+
+static uint8_t *raw_alloc(size_t size)
+{
+    if (size < HUGE_PAGE_SIZE) {
+        return new uint8_t[size];
+    }
+
+    if (explicit_huge_pages) {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            return (uint8_t *)p;
+        }
+    }
+
+    // aligned to a huge page so that all of the buffer can be backed by them
+    size_t len = size + HUGE_PAGE_SIZE;
+    void *m = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        return nullptr;
+    }
+    uint8_t *p = (uint8_t *)(((uintptr_t)m + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    size_t head = p - (uint8_t *)m;
+    if (head) {
+        munmap(m, head);
+    }
+    if (len - head > size) {
+        munmap(p + size, len - head - size);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+static void raw_free(uint8_t *p, size_t size)
+{
+    if (size < HUGE_PAGE_SIZE) {
+        delete[] p;
+    } else {
+        munmap(p, size);
+    }
+}
+
+#else
+
+static uint8_t *raw_alloc(size_t size)
+{
+    return new uint8_t[size];
+}
+
+static void raw_free(uint8_t *p, size_t size)
+{
+    delete[] p;
+}
+
+#endif
+
+Pool::~Pool()
+{
+    for (auto &l : free_lists) {
+        for (auto p : l.second) {
+            raw_free(p, l.first);
+        }
+    }
+}
+
+void set_explicit_huge_pages(bool explicit_pages)
+{
+    explicit_huge_pages = explicit_pages;
+}
+
+uint8_t *pool_alloc(size_t size)
+{
+    if (size < POOL_MIN_SIZE) {
+        return new uint8_t[size];
+    }
+
+    size_t n = class_size(size);
+    Pool &pl = pool();
+    {
+        std::lock_guard<std::mutex> guard(pl.lock);
+        auto it = pl.free_lists.find(n);
+        if (it != pl.free_lists.end() && !it->second.empty()) {
+            uint8_t *p = it->second.back();
+            it->second.pop_back();
+            pl.cached -= n;
+            return p;
+        }
+    }
+    return raw_alloc(n);
+}
+
+void pool_free(uint8_t *p, size_t size)
+{
+    if (size < POOL_MIN_SIZE) {
+        delete[] p;
+        return;
+    }
+
+    size_t n = class_size(size);
+    Pool &pl = pool();
+    {
+        std::lock_guard<std::mutex> guard(pl.lock);
+        if (pl.cached + n <= POOL_MAX_CACHED) {
+            pl.free_lists[n].push_back(p);
+            pl.cached += n;
+            return;
+        }
+    }
+    raw_free(p, n);
+}
+
+};
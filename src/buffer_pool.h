@@ -0,0 +1,79 @@
+#pragma once
+
+#include "stdc++.h"
+
+namespace I7Zip {
+
+// Process wide pool of large buffers: folder outputs, intermediate coder
+// buffers and decoder windows. Sizes are rounded up to a size class and a
+// released buffer is kept for the next request of the same class, from any
+// thread, instead of being unmapped and faulted in again.
+uint8_t *pool_alloc(size_t size);
+// size must be the one passed to pool_alloc()
+void pool_free(uint8_t *p, size_t size);
+
+// Buffers of 2 MiB and more are backed by transparent huge pages on Linux.
+// With explicit set they are taken from the reserved hugetlbfs pages first.
+void set_explicit_huge_pages(bool explicit_pages);
+
+// Owner of a buffer from the pool
+class PooledBuffer {
+public:
+    PooledBuffer() : _data(nullptr), _size(0) {}
+    PooledBuffer(const PooledBuffer &p) = delete;
+    PooledBuffer & operator=(const PooledBuffer &p) = delete;
+
+    PooledBuffer(PooledBuffer &&p) noexcept : _data(p._data), _size(p._size)
+    {
+        p._data = nullptr;
+        p._size = 0;
+    }
+
+    PooledBuffer & operator=(PooledBuffer &&p)
+    {
+        if (this != &p) {
+            release();
+            std::swap(_data, p._data);
+            std::swap(_size, p._size);
+        }
+        return *this;
+    }
+
+    ~PooledBuffer()
+    {
+        release();
+    }
+
+    bool alloc(size_t size)
+    {
+        release();
+        _data = pool_alloc(size);
+        _size = _data ? size : 0;
+        return _data != nullptr;
+    }
+
+    void release()
+    {
+        if (_data) {
+            pool_free(_data, _size);
+        }
+        _data = nullptr;
+        _size = 0;
+    }
+
+    uint8_t *data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    uint8_t *_data;
+    size_t _size;
+};
+
+};
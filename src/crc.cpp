@@ -1,8 +1,20 @@
 // Reference: https://github.com/komrad36/CRC
 // Issues about change polynomial: https://github.com/komrad36/CRC/issues/2
 
+#include <cstddef>
 #include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC_X86 1
 #include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC_TARGET(x)
+#else
+#include <cpuid.h>
+#define CRC_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
 
 namespace I7Zip {
 
@@ -531,10 +543,10 @@ static constexpr uint32_t g_tbl[] = {
 };
 
 
-uint32_t crc32(const void *M, uint32_t bytes)
+// R is the raw (not inverted) crc register
+static uint32_t crc32_table(uint32_t R, const uint8_t *M, size_t bytes)
 {
     const uint32_t *M32 = (const uint32_t *)M;
-    uint32_t R = ~0U;
 
     for (; bytes >= 16; bytes -= 16) {
         R ^= *M32++;
@@ -565,7 +577,219 @@ uint32_t crc32(const void *M, uint32_t bytes)
         R = (R >> 8) ^ g_tbl[uint8_t(R ^ *M8++)];
     }
 
-    return ~R;
+    return R;
+}
+
+#ifdef CRC_X86
+
+// Carry-less multiplication folding, see Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction". For the reflected
+// polynomial a fold over D bits uses k = reflect(x^(D+32) mod P) << 1 for the
+// low and reflect(x^(D-32) mod P) << 1 for the high qword.
+static constexpr uint64_t K512_LO = 0x154442bd4;    // 4 x 128 bits
+static constexpr uint64_t K512_HI = 0x1c6e41596;
+static constexpr uint64_t K128_LO = 0x1751997d0;    // 128 bits
+static constexpr uint64_t K128_HI = 0x0ccaa009e;
+static constexpr uint64_t K64 = 0x163cd6124;
+static constexpr uint64_t MU = 0x1f7011641;         // barrett reduction
+static constexpr uint64_t P_33 = 0x1db710641;
+static constexpr uint64_t K2048_LO = 0x11542778a;   // 4 x 512 bits
+static constexpr uint64_t K2048_HI = 0x1322d1430;
+static constexpr uint64_t K384_LO = 0x03db1ecdc;    // 3 x 128 bits
+static constexpr uint64_t K384_HI = 0x174359406;
+static constexpr uint64_t K256_LO = 0x0f1da05aa;    // 2 x 128 bits
+static constexpr uint64_t K256_HI = 0x15a546366;
+
+CRC_TARGET("pclmul,sse4.1")
+static inline __m128i fold128(__m128i x, __m128i k, __m128i next)
+{
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+// fold the remaining whole 16-byte blocks into x and reduce it to 32 bits,
+// returns the number of bytes consumed through *consumed
+CRC_TARGET("pclmul,sse4.1")
+static uint32_t crc32_reduce(__m128i x, const uint8_t *M, size_t bytes, size_t *consumed)
+{
+    const __m128i k128 = _mm_set_epi64x(K128_HI, K128_LO);
+    size_t n = 0;
+
+    for (; bytes - n >= 16; n += 16) {
+        x = fold128(x, k128, _mm_loadu_si128((const __m128i *)(M + n)));
+    }
+    *consumed = n;
+
+    // 128 -> 64 bits, this also appends the 32 zero bits of the message
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+    __m128i t = _mm_clmulepi64_si128(k128, x, 0x01);
+    x = _mm_xor_si128(_mm_srli_si128(x, 8), t);
+
+    // 64 -> 32 bits
+    t = _mm_srli_si128(x, 4);
+    x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), _mm_set_epi64x(0, K64), 0x00);
+    x = _mm_xor_si128(x, t);
+
+    // barrett reduction
+    const __m128i poly = _mm_set_epi64x(MU, P_33);
+    t = x;
+    x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), poly, 0x10);
+    x = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), poly, 0x00);
+    x = _mm_xor_si128(x, t);
+    return (uint32_t)_mm_extract_epi32(x, 1);
+}
+
+CRC_TARGET("pclmul,sse4.1")
+static uint32_t crc32_pclmul(uint32_t R, const uint8_t *M, size_t bytes)
+{
+    if (bytes < 64) {
+        return crc32_table(R, M, bytes);
+    }
+
+    const __m128i *p = (const __m128i *)M;
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128(p), _mm_cvtsi32_si128((int)R));
+    __m128i x1 = _mm_loadu_si128(p + 1);
+    __m128i x2 = _mm_loadu_si128(p + 2);
+    __m128i x3 = _mm_loadu_si128(p + 3);
+    p += 4;
+    bytes -= 64;
+
+    const __m128i k512 = _mm_set_epi64x(K512_HI, K512_LO);
+    for (; bytes >= 64; bytes -= 64, p += 4) {
+        x0 = fold128(x0, k512, _mm_loadu_si128(p));
+        x1 = fold128(x1, k512, _mm_loadu_si128(p + 1));
+        x2 = fold128(x2, k512, _mm_loadu_si128(p + 2));
+        x3 = fold128(x3, k512, _mm_loadu_si128(p + 3));
+    }
+
+    const __m128i k128 = _mm_set_epi64x(K128_HI, K128_LO);
+    x0 = fold128(x0, k128, x1);
+    x0 = fold128(x0, k128, x2);
+    x0 = fold128(x0, k128, x3);
+
+    size_t n;
+    R = crc32_reduce(x0, (const uint8_t *)p, bytes, &n);
+    return crc32_table(R, (const uint8_t *)p + n, bytes - n);
+}
+
+CRC_TARGET("avx512f,vpclmulqdq,pclmul,sse4.1")
+static inline __m512i fold512(__m512i x, __m512i k, __m512i next)
+{
+    __m512i lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+    __m512i hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+    return _mm512_ternarylogic_epi32(lo, hi, next, 0x96);
+}
+
+CRC_TARGET("avx512f,vpclmulqdq,pclmul,sse4.1")
+static uint32_t crc32_vpclmul(uint32_t R, const uint8_t *M, size_t bytes)
+{
+    if (bytes < 256) {
+        return crc32_pclmul(R, M, bytes);
+    }
+
+    const __m512i *p = (const __m512i *)M;
+    __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(p), _mm512_castsi128_si512(_mm_cvtsi32_si128((int)R)));
+    __m512i x1 = _mm512_loadu_si512(p + 1);
+    __m512i x2 = _mm512_loadu_si512(p + 2);
+    __m512i x3 = _mm512_loadu_si512(p + 3);
+    p += 4;
+    bytes -= 256;
+
+    const __m512i k2048 = _mm512_set_epi64(K2048_HI, K2048_LO, K2048_HI, K2048_LO, K2048_HI, K2048_LO, K2048_HI, K2048_LO);
+    for (; bytes >= 256; bytes -= 256, p += 4) {
+        x0 = fold512(x0, k2048, _mm512_loadu_si512(p));
+        x1 = fold512(x1, k2048, _mm512_loadu_si512(p + 1));
+        x2 = fold512(x2, k2048, _mm512_loadu_si512(p + 2));
+        x3 = fold512(x3, k2048, _mm512_loadu_si512(p + 3));
+    }
+
+    const __m512i k512 = _mm512_set_epi64(K512_HI, K512_LO, K512_HI, K512_LO, K512_HI, K512_LO, K512_HI, K512_LO);
+    x0 = fold512(x0, k512, x1);
+    x0 = fold512(x0, k512, x2);
+    x0 = fold512(x0, k512, x3);
+    for (; bytes >= 64; bytes -= 64, p++) {
+        x0 = fold512(x0, k512, _mm512_loadu_si512(p));
+    }
+
+    // fold the four 128-bit lanes onto the last one
+    __m128i lanes[4];
+    _mm512_storeu_si512(lanes, x0);
+    __m128i x = lanes[3];
+    x = fold128(lanes[0], _mm_set_epi64x(K384_HI, K384_LO), x);
+    x = fold128(lanes[1], _mm_set_epi64x(K256_HI, K256_LO), x);
+    x = fold128(lanes[2], _mm_set_epi64x(K128_HI, K128_LO), x);
+
+    size_t n;
+    R = crc32_reduce(x, (const uint8_t *)p, bytes, &n);
+    return crc32_table(R, (const uint8_t *)p + n, bytes - n);
+}
+
+static void cpuid(uint32_t leaf, uint32_t sub, uint32_t r[4])
+{
+#ifdef _MSC_VER
+    __cpuidex((int *)r, (int)leaf, (int)sub);
+#else
+    __cpuid_count(leaf, sub, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+static uint64_t xgetbv0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+#endif
+
+typedef uint32_t (*crc32_func)(uint32_t, const uint8_t *, size_t);
+
+static crc32_func select_crc32()
+{
+#ifdef CRC_X86
+    uint32_t r[4];
+    cpuid(0, 0, r);
+    uint32_t max_leaf = r[0];
+
+    cpuid(1, 0, r);
+    bool pclmul = (r[2] & (1U << 1)) != 0;
+    bool sse41 = (r[2] & (1U << 19)) != 0;
+    bool osxsave = (r[2] & (1U << 27)) != 0;
+    if (!pclmul || !sse41) {
+        return crc32_table;
+    }
+
+    if (max_leaf >= 7 && osxsave) {
+        cpuid(7, 0, r);
+        bool avx512f = (r[1] & (1U << 16)) != 0;
+        bool vpclmul = (r[2] & (1U << 10)) != 0;
+        // the OS must save xmm, ymm, opmask and all zmm state
+        bool zmm_state = (xgetbv0() & 0xe6) == 0xe6;
+        if (avx512f && vpclmul && zmm_state) {
+            return crc32_vpclmul;
+        }
+    }
+
+    return crc32_pclmul;
+#else
+    return crc32_table;
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void *M, size_t bytes)
+{
+    static const crc32_func f = select_crc32();
+    return ~f(~crc, (const uint8_t *)M, bytes);
+}
+
+uint32_t crc32(const void *M, uint32_t bytes)
+{
+    return crc32_update(0, M, bytes);
 }
 
 //uint32_t crc32(const void *M, uint32_t bytes)
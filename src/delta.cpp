@@ -0,0 +1,119 @@
+#include "method.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DELTA_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace IMethod {
+
+// Every byte is the sum of itself and the decoded byte dist before it, so
+// a stream is dist independent running sums interleaved.
+
+#ifdef DELTA_SSE2
+
+// dist of 1, 2, 4 or 8 divides a vector: a running sum inside the vector
+// in log steps, plus the last dist decoded bytes before it repeated over
+// the whole vector
+template <unsigned D>
+static void delta_decode_sse2(uint8_t *data, size_t size, size_t i)
+{
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, D));
+        if (D < 8) {
+            x = _mm_add_epi8(x, _mm_slli_si128(x, D < 8 ? 2 * D : 0));
+        }
+        if (D < 4) {
+            x = _mm_add_epi8(x, _mm_slli_si128(x, D < 4 ? 4 * D : 0));
+        }
+        if (D < 2) {
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        }
+
+        __m128i carry;
+        const uint8_t *prev = data + i - D;
+        if (D == 1) {
+            carry = _mm_set1_epi8((char)prev[0]);
+        } else if (D == 2) {
+            uint16_t v;
+            ::memcpy(&v, prev, 2);
+            carry = _mm_set1_epi16((short)v);
+        } else if (D == 4) {
+            uint32_t v;
+            ::memcpy(&v, prev, 4);
+            carry = _mm_set1_epi32((int)v);
+        } else {
+            uint64_t v;
+            ::memcpy(&v, prev, 8);
+            carry = _mm_set1_epi64x((long long)v);
+        }
+        _mm_storeu_si128((__m128i *)(data + i), _mm_add_epi8(x, carry));
+    }
+    for (; i < size; i++) {
+        data[i] += data[i - D];
+    }
+}
+
+// from 16 on the bytes dist before a vector are all decoded already
+static void delta_decode_wide(uint8_t *data, size_t size, size_t dist, size_t i)
+{
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(data + i - dist));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_add_epi8(x, y));
+    }
+    for (; i < size; i++) {
+        data[i] += data[i - dist];
+    }
+}
+
+#endif
+
+void delta_decode(unsigned char *data, size_t size, unsigned dist, unsigned char *history)
+{
+    // the first dist bytes add the end of the previous piece
+    size_t head = size < dist ? size : dist;
+    for (size_t i = 0; i < head; i++) {
+        data[i] += history[i];
+    }
+
+    size_t i = head;
+#ifdef DELTA_SSE2
+    switch (dist) {
+    case 1:
+        delta_decode_sse2<1>(data, size, i);
+        break;
+    case 2:
+        delta_decode_sse2<2>(data, size, i);
+        break;
+    case 4:
+        delta_decode_sse2<4>(data, size, i);
+        break;
+    case 8:
+        delta_decode_sse2<8>(data, size, i);
+        break;
+    default:
+        if (dist >= 16) {
+            delta_decode_wide(data, size, dist, i);
+            break;
+        }
+        for (; i < size; i++) {
+            data[i] += data[i - dist];
+        }
+    }
+#else
+    for (; i < size; i++) {
+        data[i] += data[i - dist];
+    }
+#endif
+
+    if (size >= dist) {
+        ::memcpy(history, data + size - dist, dist);
+    } else {
+        ::memmove(history, history + size, dist - size);
+        ::memcpy(history + dist - size, data, size);
+    }
+}
+
+};
@@ -0,0 +1,286 @@
+#include "glob.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace I7Zip {
+
+// decodes one code point, bytes that are not valid UTF-8 stand for themselves
+static size_t decode_utf8(const char *p, size_t size, uint32_t &c)
+{
+    const uint8_t *s = (const uint8_t *)p;
+    c = s[0];
+    size_t n = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+    if (n == 1 || c < 0xc0 || n > size) {
+        return 1;
+    }
+
+    uint32_t v = c & (0x7f >> n);
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 1;
+        }
+        v = (v << 6) | (s[i] & 0x3f);
+    }
+    c = v;
+    return n;
+}
+
+static bool starts_with(const std::string &s, const std::string &prefix)
+{
+    return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
+}
+
+static bool ends_with(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool GlobSet::add_fast_path(const std::string &pattern)
+{
+    size_t meta = pattern.find_first_of("*?[");
+    if (meta == std::string::npos) {
+        _names.insert(pattern);
+        return true;
+    }
+
+    if (meta == 0 && pattern[0] == '*') {
+        std::string rest = pattern.substr(1);
+        if (rest.find_first_of("*?[") != std::string::npos) {
+            return false;
+        }
+        if (rest.size() > 1 && rest[0] == '.' && rest.find('.', 1) == std::string::npos) {
+            _extensions.insert(rest.substr(1));
+        } else {
+            _suffixes.push_back(rest);
+        }
+        return true;
+    }
+
+    if (meta == pattern.size() - 1 && pattern[meta] == '*') {
+        _prefixes.push_back(pattern.substr(0, meta));
+        return true;
+    }
+
+    return false;
+}
+
+void GlobSet::add(const std::string &pattern)
+{
+    if (add_fast_path(pattern)) {
+        return;
+    }
+
+    Nfa nfa;
+    nfa.start = _tokens.size();
+    nfa.prefix = pattern.substr(0, pattern.find_first_of("*?["));
+
+    size_t i = 0, n = pattern.size();
+    while (i < n) {
+        uint32_t c;
+        i += decode_utf8(&pattern[i], n - i, c);
+
+        Token t{T_LITERAL, false, c, 0};
+        if (c == '*') {
+            if (_tokens.size() > nfa.start && _tokens.back().type == T_STAR) {
+                continue;
+            }
+            t.type = T_STAR;
+        } else if (c == '?') {
+            t.type = T_ANY;
+        } else if (c == '[') {
+            // same rules as fnmatch: '!' negates, a leading ']' is a member
+            // and a '[' that is never closed is just a character
+            size_t j = i;
+            if (j < n && pattern[j] == '!') {
+                j++;
+            }
+            if (j < n && pattern[j] == ']') {
+                j++;
+            }
+            while (j < n && pattern[j] != ']') {
+                j++;
+            }
+
+            if (j < n) {
+                t.type = T_SET;
+                t.c = _ranges.size();
+                if (pattern[i] == '!') {
+                    t.negate = true;
+                    i++;
+                }
+                while (i < j) {
+                    uint32_t lo, hi;
+                    i += decode_utf8(&pattern[i], j - i, lo);
+                    hi = lo;
+                    if (i + 1 < j && pattern[i] == '-') {
+                        i++;
+                        i += decode_utf8(&pattern[i], j - i, hi);
+                    }
+                    // like fnmatch, a reversed range matches nothing
+                    if (lo <= hi) {
+                        _ranges.emplace_back(lo, hi);
+                    }
+                }
+                t.num_ranges = _ranges.size() - t.c;
+                i = j + 1;
+            }
+        }
+        _tokens.push_back(t);
+    }
+
+    _tokens.push_back(Token{T_ACCEPT, false, 0, 0});
+    _num_states = _tokens.size();
+    _nfas.push_back(nfa);
+}
+
+static void set_bit(std::vector<uint64_t> &v, uint32_t i)
+{
+    v[i / 64] |= 1ull << (i % 64);
+}
+
+static uint32_t lowest_bit(uint64_t v)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, v);
+    return i;
+#else
+    return __builtin_ctzll(v);
+#endif
+}
+
+template <typename F>
+static void for_each_bit(const std::vector<uint64_t> &v, F f)
+{
+    for (size_t w = 0; w < v.size(); w++) {
+        uint64_t bits = v[w];
+        while (bits) {
+            uint32_t b = lowest_bit(bits);
+            bits &= bits - 1;
+            f((uint32_t)(w * 64 + b));
+        }
+    }
+}
+
+// a '*' may match nothing, so the token after it is active as well
+void GlobSet::closure(std::vector<uint64_t> &states) const
+{
+    for_each_bit(states, [&](uint32_t s) {
+        if (_tokens[s].type == T_STAR) {
+            set_bit(states, s + 1);
+        }
+    });
+}
+
+bool GlobSet::step(const std::vector<uint64_t> &curr, std::vector<uint64_t> &next, uint32_t c) const
+{
+    std::fill(next.begin(), next.end(), 0);
+
+    bool active = false;
+    for_each_bit(curr, [&](uint32_t s) {
+        const Token &t = _tokens[s];
+        bool in = false;
+        switch (t.type) {
+        case T_LITERAL:
+            if (t.c == c) {
+                set_bit(next, s + 1);
+                active = true;
+            }
+            break;
+        case T_ANY:
+            set_bit(next, s + 1);
+            active = true;
+            break;
+        case T_SET:
+            for (uint32_t r = t.c; r < t.c + t.num_ranges; r++) {
+                if (_ranges[r].first <= c && c <= _ranges[r].second) {
+                    in = true;
+                    break;
+                }
+            }
+            if (in != t.negate) {
+                set_bit(next, s + 1);
+                active = true;
+            }
+            break;
+        case T_STAR:
+            set_bit(next, s);
+            active = true;
+            break;
+        case T_ACCEPT:
+            break;
+        }
+    });
+
+    closure(next);
+    return active;
+}
+
+bool GlobSet::match(const std::string &name) const
+{
+    if (!_names.empty() && _names.count(name)) {
+        return true;
+    }
+
+    if (!_extensions.empty()) {
+        size_t dot = name.rfind('.');
+        if (dot != std::string::npos && _extensions.count(name.substr(dot + 1))) {
+            return true;
+        }
+    }
+
+    for (auto &p : _prefixes) {
+        if (starts_with(name, p)) {
+            return true;
+        }
+    }
+
+    for (auto &s : _suffixes) {
+        if (ends_with(name, s)) {
+            return true;
+        }
+    }
+
+    if (_nfas.empty()) {
+        return false;
+    }
+
+    auto &curr = _curr;
+    auto &next = _next;
+    curr.assign((_num_states + 63) / 64, 0);
+    next.resize(curr.size());
+    bool active = false;
+    for (auto &nfa : _nfas) {
+        if (starts_with(name, nfa.prefix)) {
+            set_bit(curr, nfa.start);
+            active = true;
+        }
+    }
+    if (!active) {
+        return false;
+    }
+    closure(curr);
+
+    const char *p = name.data();
+    size_t size = name.size();
+    while (size) {
+        uint32_t c;
+        size_t n = decode_utf8(p, size, c);
+        if (!step(curr, next, c)) {
+            return false;
+        }
+        curr.swap(next);
+        p += n;
+        size -= n;
+    }
+
+    bool accept = false;
+    for_each_bit(curr, [&](uint32_t s) {
+        accept = accept || _tokens[s].type == T_ACCEPT;
+    });
+    return accept;
+}
+
+};
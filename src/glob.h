@@ -0,0 +1,63 @@
+#pragma once
+
+#include "stdc++.h"
+
+namespace I7Zip {
+
+// A set of fnmatch style globs ('*', '?', '[seq]', '[!seq]') matched against
+// UTF-8 names. '*' also matches '/', '?' and sets match one code point.
+//
+// Globs that are a plain name, '*.ext', 'literal*' or '*literal' are looked
+// up in hash sets or compared directly. All other globs are compiled into
+// one NFA whose states are simulated together as a bitset, so a name is
+// scanned once no matter how many globs there are.
+class GlobSet {
+public:
+    GlobSet() : _num_states(0) {}
+
+    void add(const std::string &pattern);
+
+    bool match(const std::string &name) const;
+
+private:
+    enum TokenType : uint8_t {
+        T_LITERAL,
+        T_ANY,
+        T_SET,
+        T_STAR,
+        T_ACCEPT,
+    };
+
+    struct Token {
+        TokenType type;
+        bool negate;
+        uint32_t c;             // T_LITERAL code point, T_SET index of the first range
+        uint32_t num_ranges;    // T_SET
+    };
+
+    // a glob compiled into _tokens[start, ...] up to its T_ACCEPT
+    struct Nfa {
+        uint32_t start;
+        std::string prefix;     // literal head, checked before the glob is run
+    };
+
+    bool add_fast_path(const std::string &pattern);
+    bool step(const std::vector<uint64_t> &curr, std::vector<uint64_t> &next, uint32_t c) const;
+    void closure(std::vector<uint64_t> &states) const;
+
+    std::unordered_set<std::string> _names;
+    std::unordered_set<std::string> _extensions;    // '*.ext' without the '*.'
+    std::vector<std::string> _prefixes;
+    std::vector<std::string> _suffixes;
+
+    std::vector<Token> _tokens;
+    std::vector<std::pair<uint32_t, uint32_t>> _ranges;
+    std::vector<Nfa> _nfas;
+    uint32_t _num_states;
+
+    // state sets of match(), kept to not allocate them for every name
+    mutable std::vector<uint64_t> _curr;
+    mutable std::vector<uint64_t> _next;
+};
+
+};
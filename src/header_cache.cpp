@@ -0,0 +1,347 @@
+#include "7z.h"
+
+#include "fmt/core.h"
+
+// The parsed header of an archive, kept next to it as <archive>.hdr. Opening
+// the archive again maps the cache and copies the tables out of it instead
+// of decoding and parsing the header. The cache is keyed by the size and
+// mtime of the archive and the crc of its next header, and its payload is
+// covered by a crc of its own.
+
+namespace I7Zip {
+
+constexpr static uint8_t CACHE_MAGIC[8] = {'7', 'z', 's', 't', 'd', 'h', 'd', 'r'};
+constexpr static uint32_t CACHE_VERSION = 2;
+
+// archives with fewer files are parsed faster than a cache is written
+constexpr static size_t HEADER_CACHE_MIN_FILES = 4096;
+
+struct CacheHeader {
+    uint8_t magic[8];
+    uint32_t version;
+    uint32_t next_hdr_crc;
+    uint64_t archive_size;
+    uint64_t archive_mtime;
+    uint64_t payload_size;
+    uint32_t payload_crc;
+    uint32_t reserved;
+};
+
+static std::string header_cache_name(const std::string &archive)
+{
+    return archive + ".hdr";
+}
+
+class CacheWriter {
+public:
+    template <typename T>
+    void put(const T &v)
+    {
+        append(&v, sizeof(T));
+    }
+
+    template <typename T>
+    void put_vector(const T &v)
+    {
+        put<uint64_t>(v.size());
+        append(v.data(), v.size() * sizeof(v[0]));
+    }
+
+    void put_digest(const BitmapDigest &d)
+    {
+        put<uint8_t>(d._bitset != nullptr);
+        if (d._bitset) {
+            put(d._all_defined);
+            put(d._number);
+            append(d._bitset, d._size);
+            put_vector(d._crcs);
+        }
+    }
+
+    void append(const void *data, size_t size)
+    {
+        const uint8_t *p = (const uint8_t *)data;
+        _buf.insert(_buf.end(), p, p + size);
+    }
+
+    std::vector<uint8_t> _buf;
+};
+
+// Reads what CacheWriter wrote. Every read is checked against the end of the
+// payload, a failed one leaves the reader failed.
+class CacheReader {
+public:
+    CacheReader(Arena &arena, const uint8_t *data, size_t size) : _arena(arena), _p(data), _end(data + size), _ok(true) {}
+
+    template <typename T>
+    T get()
+    {
+        T v;
+        ::memset(&v, 0, sizeof(T));
+        take(&v, sizeof(T));
+        return v;
+    }
+
+    // std::vector or std::string
+    template <typename T>
+    void get_vector(T &v)
+    {
+        uint64_t n = get<uint64_t>();
+        if (n > (uint64_t)(_end - _p) / sizeof(v[0])) {
+            _ok = false;
+            return;
+        }
+        v.resize(n);
+        if (n) {
+            take(&v[0], n * sizeof(v[0]));
+        }
+    }
+
+    // an array of n elements in the arena, n read from the payload
+    template <typename T>
+    void get_array(ArenaArray<T> &v)
+    {
+        uint64_t n = get<uint64_t>();
+        if (n > (uint64_t)(_end - _p) / sizeof(T)) {
+            _ok = false;
+            return;
+        }
+        v = _arena.alloc_array<T>(n);
+        if (n) {
+            take(v.data(), n * sizeof(T));
+        }
+    }
+
+    void get_digest(BitmapDigest &d)
+    {
+        if (!get<uint8_t>()) {
+            return;
+        }
+        uint8_t all_defined = get<uint8_t>();
+        uint32_t number = get<uint32_t>();
+        if (!_ok || number / 8 > (uint64_t)(_end - _p) || !d.init(_arena, all_defined, number)) {
+            _ok = false;
+            return;
+        }
+        take(d._bitset, d._size);
+        get_array(d._crcs);
+        _ok = _ok && d._crcs.size() == number;
+    }
+
+    void take(void *dst, size_t size)
+    {
+        if (!_ok || size > (size_t)(_end - _p)) {
+            _ok = false;
+            return;
+        }
+        ::memcpy(dst, _p, size);
+        _p += size;
+    }
+
+    bool ok_so_far() const
+    {
+        return _ok;
+    }
+
+    bool ok() const
+    {
+        return _ok && _p == _end;
+    }
+
+private:
+    Arena &_arena;
+    const uint8_t *_p;
+    const uint8_t *_end;
+    bool _ok;
+};
+
+bool Archive::load_header_cache()
+{
+    std::string name = header_cache_name(_name);
+    MappedFile cache;
+    if (!cache.open(name, true) || !cache.contains(0, sizeof(CacheHeader))) {
+        return false;
+    }
+
+    CacheHeader h;
+    ::memcpy(&h, cache.data(), sizeof(h));
+    if (::memcmp(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || h.version != CACHE_VERSION ||
+        h.next_hdr_crc != _next_hdr_crc || h.archive_size != _file.size() || h.archive_mtime != _file.mtime()) {
+        return false;
+    }
+    if (!cache.contains(sizeof(CacheHeader), h.payload_size)) {
+        return false;
+    }
+
+    const uint8_t *payload = cache.data() + sizeof(CacheHeader);
+    if (crc32_update(0, payload, h.payload_size) != h.payload_crc) {
+        fmt::print("{} is corrupted, ignored\n", name);
+        return false;
+    }
+
+    CacheReader r(_arena, payload, h.payload_size);
+    _pack_pos = r.get<uint64_t>();
+    r.get_vector(_pack_size);
+    r.get_vector(_pack_offset);
+    r.get_digest(_pack_digest);
+
+    uint32_t num_folders = r.get<uint32_t>();
+    if (num_folders > h.payload_size) {
+        reset();
+        return false;
+    }
+    _folders.resize(num_folders);
+    for (auto &f : _folders) {
+        uint8_t num_coders = r.get<uint8_t>();
+        f._coders = _arena.alloc_array<Coder>(num_coders);
+        for (auto &c : f._coders) {
+            c._flag = r.get<uint8_t>();
+            r.take(c._id, sizeof(c._id));
+            c._num_in_streams = r.get<uint8_t>();
+            c._num_out_streams = r.get<uint8_t>();
+            c._start_in_index = r.get<uint16_t>();
+            c._start_out_index = r.get<uint16_t>();
+            c._unpack_size = r.get<uint64_t>();
+            c._property_size = r.get<uint32_t>();
+            if (c.has_attributes()) {
+                if (c._property_size > h.payload_size) {
+                    reset();
+                    return false;
+                }
+                c._property = _arena.alloc_array<uint8_t>(c._property_size).data();
+                r.take(c._property, c._property_size);
+            }
+        }
+        f._num_in_streams_total = r.get<uint16_t>();
+        f._num_out_streams_total = r.get<uint16_t>();
+        r.get_array(f._bind_pairs);
+        r.get_array(f._packed_streams_index);
+        f._start_packed_stream_index = r.get<uint32_t>();
+        if (!r.ok_so_far() || !f.bind(_arena)) {
+            fmt::print("{} is corrupted, ignored\n", name);
+            reset();
+            return false;
+        }
+    }
+    r.get_digest(_unpack_digest);
+
+    _substream_sizes.resize(num_folders);
+    for (auto &v : _substream_sizes) {
+        r.get_vector(v);
+    }
+    r.get_digest(_substreams_digest);
+
+    // the file table is stored array by array
+    auto &f = _files;
+    r.get_vector(f._attribute);
+    r.get_vector(f._flags);
+    r.get_vector(f._mtime);
+    r.get_vector(f._ctime);
+    r.get_vector(f._atime);
+    r.get_vector(f._names);
+    r.get_vector(f._name_offset);
+    r.get_vector(f._utf8_names);
+    r.get_vector(f._utf8_offset);
+
+    uint32_t num_files = f.size();
+    f._size.assign(num_files, 0);
+    f._offset.assign(num_files, 0);
+    f._crc.assign(num_files, 0);
+    f._folder.assign(num_files, 0);
+    bool consistent = f._attribute.size() == num_files && f._mtime.size() == num_files &&
+                      (f._ctime.empty() || f._ctime.size() == num_files) &&
+                      (f._atime.empty() || f._atime.size() == num_files) &&
+                      f._name_offset.size() == num_files + 1 && f._utf8_offset.size() == num_files + 1 &&
+                      f._name_offset.back() == f._names.size() && f._utf8_offset.back() == f._utf8_names.size();
+
+    if (!r.ok() || !consistent || !update_files_info()) {
+        fmt::print("{} is corrupted, ignored\n", name);
+        reset();
+        return false;
+    }
+    return true;
+}
+
+void Archive::save_header_cache()
+{
+    if (_files.size() < HEADER_CACHE_MIN_FILES) {
+        return;
+    }
+
+    CacheWriter w;
+    w.put(_pack_pos);
+    w.put_vector(_pack_size);
+    w.put_vector(_pack_offset);
+    w.put_digest(_pack_digest);
+
+    w.put((uint32_t)_folders.size());
+    for (auto &f : _folders) {
+        w.put((uint8_t)f._coders.size());
+        for (auto &c : f._coders) {
+            w.put(c._flag);
+            w.append(c._id, sizeof(c._id));
+            w.put(c._num_in_streams);
+            w.put(c._num_out_streams);
+            w.put(c._start_in_index);
+            w.put(c._start_out_index);
+            w.put(c._unpack_size);
+            w.put(c.has_attributes() ? c._property_size : 0);
+            if (c.has_attributes()) {
+                w.append(c._property, c._property_size);
+            }
+        }
+        w.put(f._num_in_streams_total);
+        w.put(f._num_out_streams_total);
+        w.put_vector(f._bind_pairs);
+        w.put_vector(f._packed_streams_index);
+        w.put(f._start_packed_stream_index);
+    }
+    w.put_digest(_unpack_digest);
+
+    for (auto &v : _substream_sizes) {
+        w.put_vector(v);
+    }
+    w.put_digest(_substreams_digest);
+
+    // sizes, offsets, crcs and folders follow from the substreams
+    auto &f = _files;
+    w.put_vector(f._attribute);
+    w.put_vector(f._flags);
+    w.put_vector(f._mtime);
+    w.put_vector(f._ctime);
+    w.put_vector(f._atime);
+    w.put_vector(f._names);
+    w.put_vector(f._name_offset);
+    w.put_vector(f._utf8_names);
+    w.put_vector(f._utf8_offset);
+
+    CacheHeader h;
+    ::memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    h.version = CACHE_VERSION;
+    h.next_hdr_crc = _next_hdr_crc;
+    h.archive_size = _file.size();
+    h.archive_mtime = _file.mtime();
+    h.payload_size = w._buf.size();
+    h.payload_crc = crc32_update(0, w._buf.data(), w._buf.size());
+    h.reserved = 0;
+
+    // the cache is only a shortcut, a read-only directory just goes without
+    std::string name = header_cache_name(_name);
+    std::string tmp = name + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp) {
+        return;
+    }
+    bool success = fwrite(&h, 1, sizeof(h), fp) == sizeof(h) &&
+                   fwrite(w._buf.data(), 1, w._buf.size(), fp) == w._buf.size();
+    success = fclose(fp) == 0 && success;
+    if (success) {
+        remove(name.c_str());
+        success = rename(tmp.c_str(), name.c_str()) == 0;
+    }
+    if (!success) {
+        remove(tmp.c_str());
+    }
+}
+
+};
@@ -0,0 +1,204 @@
+#include "index.h"
+
+#include "fmt/core.h"
+
+namespace I7Zip {
+
+constexpr static uint8_t INDEX_MAGIC[8] = {'7', 'z', 's', 't', 'd', 'i', 'd', 'x'};
+constexpr static uint32_t INDEX_VERSION = 1;
+
+std::string index_name(const std::string &archive)
+{
+    return archive + ".idx";
+}
+
+bool CheckpointIndex::open(const std::string &name, uint64_t archive_size, uint32_t header_crc, uint32_t num_folders)
+{
+    close();
+
+    if (!_file.open(name, true) || !_file.contains(0, sizeof(IndexHeader))) {
+        _file.close();
+        return false;
+    }
+
+    IndexHeader h;
+    ::memcpy(&h, _file.data(), sizeof(h));
+    if (::memcmp(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || h.version != INDEX_VERSION) {
+        fmt::print("{} is not an index\n", name);
+        _file.close();
+        return false;
+    }
+    if (h.layout != IMethod::checkpoint_layout() || h.archive_size != archive_size ||
+        h.header_crc != header_crc || h.num_folders != num_folders) {
+        fmt::print("{} does not match the archive, ignored\n", name);
+        _file.close();
+        return false;
+    }
+
+    uint64_t folders_size = (uint64_t)num_folders * sizeof(IndexFolder);
+    if (h.num_entries > _file.size() / sizeof(IndexEntry) ||
+        !_file.contains(h.table_offset, folders_size + h.num_entries * sizeof(IndexEntry)) ||
+        h.table_offset % alignof(IndexEntry) != 0) {
+        fmt::print("{} is truncated\n", name);
+        _file.close();
+        return false;
+    }
+
+    _folders = (const IndexFolder *)(_file.data() + h.table_offset);
+    _entries = (const IndexEntry *)(_file.data() + h.table_offset + folders_size);
+    _num_folders = num_folders;
+    for (uint32_t i = 0; i < num_folders; i++) {
+        if (_folders[i].first_entry > h.num_entries || _folders[i].num_entries > h.num_entries - _folders[i].first_entry) {
+            fmt::print("{} is corrupted\n", name);
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void CheckpointIndex::close()
+{
+    _file.close();
+    _folders = nullptr;
+    _entries = nullptr;
+    _num_folders = 0;
+}
+
+bool CheckpointIndex::find(uint32_t folder, uint64_t offset, IMethod::Checkpoint &cp) const
+{
+    if (!is_open() || folder >= _num_folders) {
+        return false;
+    }
+
+    // entries of a folder are sorted by unpack offset
+    const IndexEntry *first = _entries + _folders[folder].first_entry;
+    const IndexEntry *last = first + _folders[folder].num_entries;
+    const IndexEntry *e = std::upper_bound(first, last, offset, [](uint64_t v, const IndexEntry &x) {
+        return v < x.unpack_offset;
+    });
+    if (e == first) {
+        return false;
+    }
+    --e;
+
+    if ((e->state_size && !_file.contains(e->state_offset, e->state_size)) ||
+        !_file.contains(e->history_offset, e->history_size)) {
+        return false;
+    }
+    cp.packed_offset = e->packed_offset;
+    cp.unpack_offset = e->unpack_offset;
+    cp.state = e->state_size ? _file.data() + e->state_offset : nullptr;
+    cp.state_size = e->state_size;
+    cp.history = _file.data() + e->history_offset;
+    cp.history_size = e->history_size;
+    return true;
+}
+
+CheckpointIndexWriter::~CheckpointIndexWriter()
+{
+    // finish() was not reached, drop the partial index
+    if (_fp) {
+        fclose(_fp);
+        remove((_name + ".tmp").c_str());
+    }
+}
+
+bool CheckpointIndexWriter::open(const std::string &name, uint32_t num_folders)
+{
+    _name = name;
+    std::string tmp = name + ".tmp";
+    _fp = fopen(tmp.c_str(), "wb");
+    if (!_fp) {
+        fmt::print("fopen({}, 'wb') failed errno {}\n", tmp, errno);
+        return false;
+    }
+
+    // the header is written again once the table offset is known
+    IndexHeader h;
+    ::memset(&h, 0, sizeof(h));
+    _pos = 0;
+    _folders.assign(num_folders, IndexFolder{0, 0});
+    _entries.clear();
+    return write(&h, sizeof(h));
+}
+
+bool CheckpointIndexWriter::write(const void *data, size_t size)
+{
+    if (size && fwrite(data, 1, size, _fp) != size) {
+        fmt::print("fwrite() failed {}\n", size);
+        return false;
+    }
+    _pos += size;
+    return true;
+}
+
+bool CheckpointIndexWriter::add(uint32_t folder, const IMethod::Checkpoint &cp)
+{
+    auto &f = _folders[folder];
+    if (f.num_entries == 0) {
+        f.first_entry = (uint32_t)_entries.size();
+    }
+    f.num_entries++;
+
+    IndexEntry e;
+    e.packed_offset = cp.packed_offset;
+    e.unpack_offset = cp.unpack_offset;
+    e.state_offset = cp.state ? _pos : 0;
+    e.state_size = (uint32_t)cp.state_size;
+    if (!write(cp.state, cp.state_size)) {
+        return false;
+    }
+    e.history_offset = _pos;
+    e.history_size = (uint32_t)cp.history_size;
+    if (!write(cp.history, cp.history_size)) {
+        return false;
+    }
+    _entries.push_back(e);
+    return true;
+}
+
+bool CheckpointIndexWriter::finish(uint64_t archive_size, uint32_t header_crc)
+{
+    // the records are read in place from the mapping
+    uint8_t pad[alignof(IndexEntry)] = {0};
+    if (!write(pad, (size_t)(-_pos % alignof(IndexEntry)))) {
+        return false;
+    }
+
+    IndexHeader h;
+    ::memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    h.version = INDEX_VERSION;
+    h.layout = IMethod::checkpoint_layout();
+    h.archive_size = archive_size;
+    h.header_crc = header_crc;
+    h.num_folders = (uint32_t)_folders.size();
+    h.table_offset = _pos;
+    h.num_entries = _entries.size();
+
+    if (!write(_folders.data(), _folders.size() * sizeof(IndexFolder)) ||
+        !write(_entries.data(), _entries.size() * sizeof(IndexEntry))) {
+        return false;
+    }
+    if (fseek(_fp, 0, SEEK_SET) != 0 || fwrite(&h, 1, sizeof(h), _fp) != sizeof(h)) {
+        fmt::print("writing the index header failed\n");
+        return false;
+    }
+
+    int err = fclose(_fp);
+    _fp = nullptr;
+    std::string tmp = _name + ".tmp";
+    if (err != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    remove(_name.c_str());
+    if (rename(tmp.c_str(), _name.c_str()) != 0) {
+        fmt::print("rename({}) failed errno {}\n", tmp, errno);
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "stdc++.h"
+#include "mapped_file.h"
+#include "method.h"
+
+namespace I7Zip {
+
+// Decoder checkpoints of the LZMA and LZMA2 folders of an archive, built by
+// one full pass and kept next to it as <archive>.idx. A file in the middle
+// of a solid folder is then decoded from the last checkpoint before it
+// instead of from the start of the folder.
+//
+// Layout: IndexHeader, the saved decoder states and dictionaries, then one
+// IndexFolder per folder and the IndexEntry records of all folders.
+struct IndexHeader {
+    uint8_t magic[8];
+    uint32_t version;
+    uint32_t layout;            // IMethod::checkpoint_layout() of the writer
+    uint64_t archive_size;
+    uint32_t header_crc;        // crc of the archive's next header
+    uint32_t num_folders;
+    uint64_t table_offset;      // IndexFolder records, then the IndexEntry records
+    uint64_t num_entries;
+};
+
+struct IndexFolder {
+    uint32_t first_entry;
+    uint32_t num_entries;
+};
+
+struct IndexEntry {
+    uint64_t packed_offset;
+    uint64_t unpack_offset;
+    uint64_t state_offset;      // 0 at an LZMA2 dictionary reset
+    uint64_t history_offset;
+    uint32_t state_size;
+    uint32_t history_size;
+};
+
+std::string index_name(const std::string &archive);
+
+class CheckpointIndex {
+public:
+    CheckpointIndex() : _folders(nullptr), _entries(nullptr), _num_folders(0) {}
+    CheckpointIndex(const CheckpointIndex &p) = delete;
+    CheckpointIndex & operator=(const CheckpointIndex &p) = delete;
+
+    // fails quietly when there is no index, and when it was built for
+    // another archive or by a build with other decoder structures
+    bool open(const std::string &name, uint64_t archive_size, uint32_t header_crc, uint32_t num_folders);
+    void close();
+
+    bool is_open() const
+    {
+        return _folders != nullptr;
+    }
+
+    // the last checkpoint of folder at or before unpack offset
+    bool find(uint32_t folder, uint64_t offset, IMethod::Checkpoint &cp) const;
+
+private:
+    MappedFile _file;
+    const IndexFolder *_folders;
+    const IndexEntry *_entries;
+    uint32_t _num_folders;
+};
+
+// Writes an index folder by folder. Saved states and dictionaries go to the
+// file as they are added, so only the small records stay in memory. The
+// index is built under a temporary name and renamed once complete.
+class CheckpointIndexWriter {
+public:
+    CheckpointIndexWriter() : _fp(nullptr), _pos(0) {}
+    CheckpointIndexWriter(const CheckpointIndexWriter &p) = delete;
+    CheckpointIndexWriter & operator=(const CheckpointIndexWriter &p) = delete;
+
+    ~CheckpointIndexWriter();
+
+    bool open(const std::string &name, uint32_t num_folders);
+
+    // checkpoints are added in increasing order of folder and offset
+    bool add(uint32_t folder, const IMethod::Checkpoint &cp);
+
+    bool finish(uint64_t archive_size, uint32_t header_crc);
+
+private:
+    bool write(const void *data, size_t size);
+
+    std::string _name;
+    FILE *_fp;
+    uint64_t _pos;
+    std::vector<IndexFolder> _folders;
+    std::vector<IndexEntry> _entries;
+};
+
+};
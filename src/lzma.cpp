@@ -1,8 +1,9 @@
 #include "method.h"
+#include "parallel.h"
+#include "buffer_pool.h"
 #include "LzmaDec.h"
 #include "Lzma2Dec.h"
 #include "Bcj2.h"
-#include "Bra.h"
 #include "mimalloc.h"
 
 namespace IMethod {
@@ -20,27 +21,734 @@ static void my_free(ISzAllocPtr _p, void *p)
 
 const ISzAlloc g_alloc = {my_alloc, my_free};
 
+// The probability tables stay allocated between uses and are only replaced
+// when a stream needs a different number of them (lc + lp of LZMA).
+struct LzmaContext {
+    CLzmaDec dec;
+
+    LzmaContext()
+    {
+        LzmaDec_Construct(&dec);
+    }
+
+    ~LzmaContext()
+    {
+        LzmaDec_FreeProbs(&dec, &g_alloc);
+    }
+};
+
+struct Lzma2Context {
+    CLzma2Dec dec;
+
+    Lzma2Context()
+    {
+        Lzma2Dec_Construct(&dec);
+    }
+
+    ~Lzma2Context()
+    {
+        Lzma2Dec_FreeProbs(&dec, &g_alloc);
+    }
+};
+
+static ContextPool<LzmaContext> lzma_contexts;
+static ContextPool<Lzma2Context> lzma2_contexts;
+
+// LzmaDecode() and Lzma2Decode() on a pooled decoder
 int lzma_decompress(unsigned char *dest, size_t *destLen,
                     const unsigned char *src, size_t *srcLen,
                     const unsigned char *props, size_t propsSize)
 {
+    size_t out_size = *destLen;
+    *destLen = 0;
+
+    PooledContext<LzmaContext> ctx(lzma_contexts);
+    CLzmaDec *dec = &ctx->dec;
+    int err = LzmaDec_AllocateProbs(dec, props, (unsigned)propsSize, &g_alloc);
+    if (err) {
+        *srcLen = 0;
+        return err;
+    }
+
+    dec->dic = dest;
+    dec->dicBufSize = out_size;
+    LzmaDec_Init(dec);
+
     ELzmaStatus status;
-    return LzmaDecode(dest, destLen, src, srcLen, props, (unsigned)propsSize, LZMA_FINISH_ANY, &status, &g_alloc);
+    err = LzmaDec_DecodeToDic(dec, out_size, src, srcLen, LZMA_FINISH_ANY, &status);
+    *destLen = dec->dicPos;
+    dec->dic = nullptr;
+    if (err == SZ_OK && status == LZMA_STATUS_NEEDS_MORE_INPUT) {
+        err = SZ_ERROR_INPUT_EOF;
+    }
+    return err;
+}
+
+// Drive an LZMA or LZMA2 decoder whose dictionary is dec->dic, either the
+// whole destination or a circular window. Every call stops after at most
+// STREAM_STEP bytes so the sink sees the data while it is still in cache.
+// With a source the decoder is given what has been written of src so far.
+template <typename Decoder, typename DecodeToDic>
+static int decode_to_dic(Decoder *p, CLzmaDec *dec, size_t destLen,
+                            const unsigned char *src, size_t srcLen,
+                            DecodeToDic decode, const Sink &sink,
+                            const Source &source = nullptr)
+{
+    size_t in_pos = 0;
+    size_t out_total = 0;
+
+    while (out_total < destLen) {
+        if (dec->dicPos == dec->dicBufSize) {
+            dec->dicPos = 0;
+        }
+
+        size_t start = dec->dicPos;
+        size_t limit = dec->dicBufSize - start;
+        if (limit > STREAM_STEP) {
+            limit = STREAM_STEP;
+        }
+        if (limit > destLen - out_total) {
+            limit = destLen - out_total;
+        }
+
+        ELzmaStatus status;
+        size_t avail = source ? std::min(source(in_pos), srcLen) : srcLen;
+        size_t in_processed = avail - in_pos;
+        int err = decode(p, start + limit, src + in_pos, &in_processed, LZMA_FINISH_ANY, &status);
+        in_pos += in_processed;
+
+        size_t produced = dec->dicPos - start;
+        out_total += produced;
+        if (produced && !sink(dec->dic + start, produced)) {
+            return SZ_ERROR_PROGRESS;
+        }
+        if (err) {
+            return err;
+        }
+        if (produced == 0 && (in_processed == 0 || status == LZMA_STATUS_FINISHED_WITH_MARK)) {
+            return SZ_ERROR_INPUT_EOF;
+        }
+    }
+
+    return SZ_OK;
+}
+
+static size_t window_size(size_t destLen, size_t windowSize, uint64_t dicSize)
+{
+    if (windowSize < dicSize) {
+        windowSize = dicSize;
+    }
+    return windowSize < destLen ? windowSize : destLen;
+}
+
+static uint64_t lzma2_dic_size(unsigned char prop)
+{
+    return (prop == 40) ? 0xFFFFFFFF : ((uint32_t)2 | (prop & 1)) << (prop / 2 + 11);
+}
+
+static int lzma_decode(Byte *dic, size_t dicSize, size_t destLen,
+                       const unsigned char *src, size_t srcLen,
+                       const unsigned char *props, size_t propsSize,
+                       const Sink &sink, const Source &source = nullptr)
+{
+    PooledContext<LzmaContext> ctx(lzma_contexts);
+    CLzmaDec *dec = &ctx->dec;
+    int err = LzmaDec_AllocateProbs(dec, props, (unsigned)propsSize, &g_alloc);
+    if (err) {
+        return err;
+    }
+
+    dec->dic = dic;
+    dec->dicBufSize = dicSize;
+    LzmaDec_Init(dec);
+
+    err = decode_to_dic(dec, dec, destLen, src, srcLen, LzmaDec_DecodeToDic, sink, source);
+    dec->dic = nullptr;
+    return err;
+}
+
+static int lzma2_decode(Byte *dic, size_t dicSize, size_t destLen,
+                        const unsigned char *src, size_t srcLen,
+                        unsigned char prop, const Sink &sink)
+{
+    PooledContext<Lzma2Context> ctx(lzma2_contexts);
+    CLzma2Dec *dec = &ctx->dec;
+    int err = Lzma2Dec_AllocateProbs(dec, prop, &g_alloc);
+    if (err) {
+        return err;
+    }
+
+    dec->decoder.dic = dic;
+    dec->decoder.dicBufSize = dicSize;
+    Lzma2Dec_Init(dec);
+
+    err = decode_to_dic(dec, &dec->decoder, destLen, src, srcLen, Lzma2Dec_DecodeToDic, sink);
+    dec->decoder.dic = nullptr;
+    return err;
+}
+
+int lzma_decompress(unsigned char *dest, size_t destLen,
+                    const unsigned char *src, size_t srcLen,
+                    const unsigned char *props, size_t propsSize,
+                    const Sink &sink, const Source &source)
+{
+    if (destLen == 0) {
+        return SZ_OK;
+    }
+    return lzma_decode(dest, destLen, destLen, src, srcLen, props, propsSize, sink, source);
+}
+
+int lzma_decompress_stream(size_t destLen, size_t windowSize,
+                           const unsigned char *src, size_t srcLen,
+                           const unsigned char *props, size_t propsSize,
+                           const Sink &sink)
+{
+    CLzmaProps p;
+    int err = LzmaProps_Decode(&p, props, (unsigned)propsSize);
+    if (err) {
+        return err;
+    }
+
+    size_t size = window_size(destLen, windowSize, p.dicSize);
+    if (size == 0) {
+        return SZ_OK;
+    }
+
+    Byte *dic = (Byte *)I7Zip::pool_alloc(size);
+    if (!dic) {
+        return SZ_ERROR_MEM;
+    }
+    err = lzma_decode(dic, size, destLen, src, srcLen, props, propsSize, sink);
+    I7Zip::pool_free(dic, size);
+    return err;
+}
+
+int lzma2_decompress(unsigned char *dest, size_t destLen,
+                     const unsigned char *src, size_t srcLen,
+                     unsigned char prop, const Sink &sink)
+{
+    if (prop > 40) {
+        return SZ_ERROR_UNSUPPORTED;
+    }
+    if (destLen == 0) {
+        return SZ_OK;
+    }
+    return lzma2_decode(dest, destLen, destLen, src, srcLen, prop, sink);
+}
+
+// A run of LZMA2 chunks starting with a dictionary reset, it can be decoded
+// without any of the data before it
+struct Lzma2Block {
+    size_t packed_offset;
+    size_t packed_size;
+    size_t unpack_offset;
+    size_t unpack_size;
+};
+
+// Walk the chunk headers and cut the stream at every dictionary reset
+// (control 0x01 or >= 0xE0). Only headers are read, nothing is decoded.
+// The walk ends at the block holding byte destLen - 1, that block is cut.
+static bool lzma2_split(const unsigned char *src, size_t srcLen, size_t destLen,
+                        std::vector<Lzma2Block> &blocks)
+{
+    size_t pos = 0;
+    size_t unpacked = 0;
+
+    while (pos < srcLen && src[pos] != 0 && unpacked < destLen) {
+        unsigned control = src[pos];
+        size_t header, packed, unpack;
+        bool reset_dic;
+
+        if (control == 1 || control == 2) {
+            header = 3;
+            if (srcLen - pos < header) {
+                return false;
+            }
+            unpack = (((size_t)src[pos + 1] << 8) | src[pos + 2]) + 1;
+            packed = unpack;
+            reset_dic = control == 1;
+        } else if (control >= 0x80) {
+            header = control >= 0xC0 ? 6 : 5;
+            if (srcLen - pos < header) {
+                return false;
+            }
+            unpack = (((size_t)(control & 0x1F) << 16) | ((size_t)src[pos + 1] << 8) | src[pos + 2]) + 1;
+            packed = (((size_t)src[pos + 3] << 8) | src[pos + 4]) + 1;
+            reset_dic = control >= 0xE0;
+        } else {
+            return false;
+        }
+
+        if (reset_dic || blocks.empty()) {
+            blocks.push_back({pos, 0, unpacked, 0});
+        }
+
+        pos += header + packed;
+        unpacked += unpack;
+        if (pos > srcLen) {
+            return false;
+        }
+        blocks.back().packed_size = pos - blocks.back().packed_offset;
+        blocks.back().unpack_size += unpack;
+    }
+
+    if (unpacked > destLen) {
+        blocks.back().unpack_size -= unpacked - destLen;
+        unpacked = destLen;
+    }
+    return unpacked == destLen;
+}
+
+int lzma2_decompress_mt(unsigned char *dest, size_t destLen,
+                        const unsigned char *src, size_t srcLen,
+                        unsigned char prop, uint32_t numThreads,
+                        const Sink &sink)
+{
+    std::vector<Lzma2Block> blocks;
+    if (numThreads < 2 || !lzma2_split(src, srcLen, destLen, blocks) || blocks.size() < 2) {
+        return lzma2_decompress(dest, destLen, src, srcLen, prop, sink);
+    }
+    if (prop > 40) {
+        return SZ_ERROR_UNSUPPORTED;
+    }
+
+    std::atomic<int> error(SZ_OK);
+    Sink none = [](const unsigned char *, size_t) {
+        return true;
+    };
+
+    I7Zip::parallel_for_ordered(blocks.size(), numThreads, [&](uint32_t i) {
+        auto &b = blocks[i];
+        int err = lzma2_decode(dest + b.unpack_offset, b.unpack_size, b.unpack_size,
+                               src + b.packed_offset, b.packed_size, prop, none);
+        if (err) {
+            error = err;
+        }
+        return err == SZ_OK;
+    }, [&](uint32_t i) {
+        if (!sink(dest + blocks[i].unpack_offset, blocks[i].unpack_size)) {
+            error = SZ_ERROR_PROGRESS;
+            return false;
+        }
+        return true;
+    });
+
+    return error;
+}
+
+int lzma2_decompress_stream(size_t destLen, size_t windowSize,
+                            const unsigned char *src, size_t srcLen,
+                            unsigned char prop, const Sink &sink)
+{
+    if (prop > 40) {
+        return SZ_ERROR_UNSUPPORTED;
+    }
+
+    size_t size = window_size(destLen, windowSize, lzma2_dic_size(prop));
+    if (size == 0) {
+        return SZ_OK;
+    }
+
+    Byte *dic = (Byte *)I7Zip::pool_alloc(size);
+    if (!dic) {
+        return SZ_ERROR_MEM;
+    }
+    int err = lzma2_decode(dic, size, destLen, src, srcLen, prop, sink);
+    I7Zip::pool_free(dic, size);
+    return err;
+}
+
+uint32_t checkpoint_layout()
+{
+    return (uint32_t)(sizeof(CLzmaDec) | sizeof(CLzma2Dec) << 12 | sizeof(CLzmaProb) << 24);
+}
+
+// Saved decoders are the decoder struct followed by the probabilities. The
+// pointers in the struct are stale once loaded again and are replaced.
+template <typename Decoder>
+static void save_state(const Decoder *p, const CLzmaDec *dec, std::vector<unsigned char> &state)
+{
+    size_t probs = dec->numProbs * sizeof(CLzmaProb);
+    state.resize(sizeof(Decoder) + probs);
+    ::memcpy(state.data(), p, sizeof(Decoder));
+    ::memcpy(state.data() + sizeof(Decoder), dec->probs, probs);
+}
+
+// Limits private to LzmaDec.c and Lzma2Dec.c, a loaded state is checked
+// against them before LzmaDec indexes its buffers with it.
+constexpr static UInt32 LZMA_NUM_STATES = 12;
+constexpr static UInt32 LZMA_MATCH_SPEC_LEN_START = 2 + 16 * 2 + 256;
+constexpr static unsigned LZMA2_STATE_FINISHED = 8;
+constexpr static unsigned LZMA2_LCLP_MAX = 4;
+
+// an LZMA stream keeps the properties of its coder
+static bool valid_props(const CLzmaDec *p, const CLzmaProps &prop)
+{
+    return p->prop.lc == prop.lc && p->prop.lp == prop.lp && p->prop.pb == prop.pb &&
+           p->prop.dicSize == prop.dicSize;
+}
+
+// LZMA2 chunks may change lc, lp and pb within the probabilities allocated
+// for lc + lp = 4
+static bool valid_props(const CLzma2Dec *p, const CLzmaProps &prop)
+{
+    const CLzmaDec *dec = &p->decoder;
+    return p->state <= LZMA2_STATE_FINISHED && p->isExtraMode <= 1 &&
+           dec->prop.lc + dec->prop.lp <= LZMA2_LCLP_MAX && dec->prop.pb <= 4 &&
+           dec->prop.dicSize == prop.dicSize;
+}
+
+// The index is not trusted: the restored fields have to be ones the decoder
+// can reach, with every distance inside the saved history.
+template <typename Decoder>
+static bool valid_state(const Decoder *p, const CLzmaDec *dec, const CLzmaProps &prop, size_t history_size)
+{
+    if (!valid_props(p, prop) || dec->tempBufSize > LZMA_REQUIRED_INPUT_MAX ||
+        dec->remainLen > LZMA_MATCH_SPEC_LEN_START + 2) {
+        return false;
+    }
+    if (dec->checkDicSize != 0 && dec->checkDicSize != dec->prop.dicSize) {
+        return false;
+    }
+    UInt32 limit = dec->checkDicSize ? dec->checkDicSize : dec->processedPos;
+    if (limit > history_size) {
+        return false;
+    }
+    // state and reps are reset before use after a state reset
+    if (dec->remainLen <= LZMA_MATCH_SPEC_LEN_START + 1) {
+        if (dec->state >= LZMA_NUM_STATES) {
+            return false;
+        }
+        for (UInt32 rep : dec->reps) {
+            if (rep == 0 || rep > (limit ? limit : 1)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename Decoder>
+static bool load_state(Decoder *p, CLzmaDec *dec, const unsigned char *state, size_t size, size_t history_size)
+{
+    size_t probs = dec->numProbs * sizeof(CLzmaProb);
+    if (size != sizeof(Decoder) + probs) {
+        return false;
+    }
+
+    CLzmaDec keep = *dec;
+    ::memcpy((void *)p, state, sizeof(Decoder));
+    if (dec->numProbs != keep.numProbs || !valid_state(p, dec, keep.prop, history_size)) {
+        *dec = keep;
+        return false;
+    }
+    dec->probs = keep.probs;
+    dec->probs_1664 = keep.probs_1664;
+    dec->dic = keep.dic;
+    dec->dicBufSize = keep.dicBufSize;
+    dec->buf = nullptr;
+    ::memcpy(dec->probs, state + sizeof(Decoder), probs);
+    return true;
+}
+
+// Same loop as decode_to_dic() through a window of the dictionary size.
+// Between two steps the decoder is idle and is saved whenever interval bytes
+// have passed since the last checkpoint. resets are LZMA2 blocks, their
+// starts are passed on as checkpoints without a saved state.
+template <typename Decoder, typename DecodeToDic>
+static int build_checkpoints(Decoder *p, CLzmaDec *dec, size_t destLen, uint64_t dicSize,
+                             const unsigned char *src, size_t srcLen, DecodeToDic decode,
+                             size_t interval, const std::vector<Lzma2Block> &resets,
+                             const CheckpointSink &save)
+{
+    size_t size = window_size(destLen, 0, dicSize);
+    Byte *dic = (Byte *)I7Zip::pool_alloc(size);
+    if (!dic) {
+        return SZ_ERROR_MEM;
+    }
+    dec->dic = dic;
+    dec->dicBufSize = size;
+
+    std::vector<unsigned char> state, history;
+    size_t next_reset = 0;
+    size_t last = 0;
+    size_t in_pos = 0;
+    size_t out_total = 0;
+    int err = SZ_OK;
+
+    while (out_total < destLen) {
+        if (dec->dicPos == dec->dicBufSize) {
+            dec->dicPos = 0;
+        }
+
+        size_t start = dec->dicPos;
+        size_t limit = dec->dicBufSize - start;
+        if (limit > STREAM_STEP) {
+            limit = STREAM_STEP;
+        }
+        if (limit > destLen - out_total) {
+            limit = destLen - out_total;
+        }
+
+        ELzmaStatus status;
+        size_t in_processed = srcLen - in_pos;
+        err = decode(p, start + limit, src + in_pos, &in_processed, LZMA_FINISH_ANY, &status);
+        in_pos += in_processed;
+
+        size_t produced = dec->dicPos - start;
+        out_total += produced;
+        if (err) {
+            break;
+        }
+        if (produced == 0 && (in_processed == 0 || status == LZMA_STATUS_FINISHED_WITH_MARK)) {
+            err = SZ_ERROR_INPUT_EOF;
+            break;
+        }
+
+        for (; next_reset < resets.size() && resets[next_reset].unpack_offset <= out_total; next_reset++) {
+            auto &b = resets[next_reset];
+            if (b.unpack_offset == 0) {
+                continue;
+            }
+            if (!save(Checkpoint{b.packed_offset, b.unpack_offset, nullptr, 0, nullptr, 0})) {
+                err = SZ_ERROR_PROGRESS;
+                break;
+            }
+            last = b.unpack_offset;
+        }
+        if (err) {
+            break;
+        }
+        if (out_total - last < interval || out_total == destLen) {
+            continue;
+        }
+
+        // the dictionary ends at dicPos and may wrap around the window
+        size_t h = out_total < dicSize ? out_total : (size_t)dicSize;
+        size_t end = dec->dicPos;
+        history.resize(h);
+        if (h <= end) {
+            ::memcpy(history.data(), dic + end - h, h);
+        } else {
+            ::memcpy(history.data(), dic + size - (h - end), h - end);
+            ::memcpy(history.data() + h - end, dic, end);
+        }
+        save_state(p, dec, state);
+
+        if (!save(Checkpoint{in_pos, out_total, state.data(), state.size(), history.data(), h})) {
+            err = SZ_ERROR_PROGRESS;
+            break;
+        }
+        last = out_total;
+    }
+
+    dec->dic = nullptr;
+    I7Zip::pool_free(dic, size);
+    return err;
+}
+
+// Decode from a checkpoint. Saved states continue behind their history in
+// a window holding both, the output is copied to dest step by step.
+template <typename Decoder, typename DecodeToDic>
+static int resume(Decoder *p, CLzmaDec *dec, const Checkpoint &cp, unsigned char *dest, size_t destLen,
+                  const unsigned char *src, size_t srcLen, DecodeToDic decode, const Sink &sink)
+{
+    if (cp.packed_offset > srcLen) {
+        return SZ_ERROR_DATA;
+    }
+    src += cp.packed_offset;
+    srcLen -= cp.packed_offset;
+
+    if (!cp.state) {
+        dec->dic = dest;
+        dec->dicBufSize = destLen;
+        int err = decode_to_dic(p, dec, destLen, src, srcLen, decode, sink);
+        dec->dic = nullptr;
+        return err;
+    }
+
+    size_t size = cp.history_size + destLen;
+    Byte *dic = (Byte *)I7Zip::pool_alloc(size);
+    if (!dic) {
+        return SZ_ERROR_MEM;
+    }
+    dec->dic = dic;
+    dec->dicBufSize = size;
+
+    int err = SZ_ERROR_DATA;
+    if (load_state(p, dec, cp.state, cp.state_size, cp.history_size)) {
+        ::memcpy(dic, cp.history, cp.history_size);
+        dec->dicPos = cp.history_size;
+
+        size_t pos = 0;
+        err = decode_to_dic(p, dec, destLen, src, srcLen, decode, [&](const unsigned char *data, size_t n) {
+            ::memcpy(dest + pos, data, n);
+            pos += n;
+            return sink(dest + pos - n, n);
+        });
+    }
+
+    dec->dic = nullptr;
+    I7Zip::pool_free(dic, size);
+    return err;
+}
+
+static size_t checkpoint_interval(size_t interval, uint64_t dicSize)
+{
+    if (interval) {
+        return interval;
+    }
+    // every saved state carries a whole dictionary, keep them a few
+    // dictionaries apart
+    uint64_t v = dicSize * 4;
+    return v < ((uint64_t)8 << 20) ? ((size_t)8 << 20) : (size_t)v;
+}
+
+int lzma_checkpoints(size_t destLen, const unsigned char *src, size_t srcLen,
+                     const unsigned char *props, size_t propsSize,
+                     size_t interval, const CheckpointSink &save)
+{
+    PooledContext<LzmaContext> ctx(lzma_contexts);
+    CLzmaDec *dec = &ctx->dec;
+    int err = LzmaDec_AllocateProbs(dec, props, (unsigned)propsSize, &g_alloc);
+    if (err) {
+        return err;
+    }
+    LzmaDec_Init(dec);
+
+    uint64_t dic_size = dec->prop.dicSize;
+    return build_checkpoints(dec, dec, destLen, dic_size, src, srcLen, LzmaDec_DecodeToDic,
+                             checkpoint_interval(interval, dic_size), {}, save);
+}
+
+int lzma2_checkpoints(size_t destLen, const unsigned char *src, size_t srcLen,
+                      unsigned char prop, size_t interval, const CheckpointSink &save)
+{
+    if (prop > 40) {
+        return SZ_ERROR_UNSUPPORTED;
+    }
+    uint64_t dic_size = lzma2_dic_size(prop);
+    interval = checkpoint_interval(interval, dic_size);
+
+    // streams from multithreaded encoders need no decoding at all when their
+    // blocks are small enough
+    std::vector<Lzma2Block> blocks;
+    if (!lzma2_split(src, srcLen, destLen, blocks)) {
+        blocks.clear();
+    }
+    bool small = !blocks.empty();
+    for (auto &b : blocks) {
+        small = small && b.unpack_size <= interval;
+    }
+    if (small) {
+        for (auto &b : blocks) {
+            if (b.unpack_offset && !save(Checkpoint{b.packed_offset, b.unpack_offset, nullptr, 0, nullptr, 0})) {
+                return SZ_ERROR_PROGRESS;
+            }
+        }
+        return SZ_OK;
+    }
+
+    PooledContext<Lzma2Context> ctx(lzma2_contexts);
+    CLzma2Dec *dec = &ctx->dec;
+    int err = Lzma2Dec_AllocateProbs(dec, prop, &g_alloc);
+    if (err) {
+        return err;
+    }
+    Lzma2Dec_Init(dec);
+
+    return build_checkpoints(dec, &dec->decoder, destLen, dic_size, src, srcLen, Lzma2Dec_DecodeToDic,
+                             interval, blocks, save);
+}
+
+int lzma_resume(const Checkpoint &cp, unsigned char *dest, size_t destLen,
+                const unsigned char *src, size_t srcLen,
+                const unsigned char *props, size_t propsSize, const Sink &sink)
+{
+    if (!cp.state) {
+        return SZ_ERROR_DATA;
+    }
+
+    PooledContext<LzmaContext> ctx(lzma_contexts);
+    CLzmaDec *dec = &ctx->dec;
+    int err = LzmaDec_AllocateProbs(dec, props, (unsigned)propsSize, &g_alloc);
+    if (err) {
+        return err;
+    }
+    return resume(dec, dec, cp, dest, destLen, src, srcLen, LzmaDec_DecodeToDic, sink);
+}
+
+int lzma2_resume(const Checkpoint &cp, unsigned char *dest, size_t destLen,
+                 const unsigned char *src, size_t srcLen,
+                 unsigned char prop, const Sink &sink)
+{
+    if (prop > 40) {
+        return SZ_ERROR_UNSUPPORTED;
+    }
+
+    PooledContext<Lzma2Context> ctx(lzma2_contexts);
+    CLzma2Dec *dec = &ctx->dec;
+    int err = Lzma2Dec_AllocateProbs(dec, prop, &g_alloc);
+    if (err) {
+        return err;
+    }
+    Lzma2Dec_Init(dec);
+    return resume(dec, &dec->decoder, cp, dest, destLen, src, srcLen, Lzma2Dec_DecodeToDic, sink);
 }
 
 int lzma2_decompress(unsigned char *dest, size_t *destLen,
                      const unsigned char *src, size_t *srcLen,
                      unsigned char prop)
 {
+    size_t out_size = *destLen;
+    *destLen = 0;
+
+    PooledContext<Lzma2Context> ctx(lzma2_contexts);
+    CLzma2Dec *dec = &ctx->dec;
+    int err = Lzma2Dec_AllocateProbs(dec, prop, &g_alloc);
+    if (err) {
+        *srcLen = 0;
+        return err;
+    }
+
+    dec->decoder.dic = dest;
+    dec->decoder.dicBufSize = out_size;
+    Lzma2Dec_Init(dec);
+
     ELzmaStatus status;
-    return Lzma2Decode(dest, destLen, src, srcLen, prop, LZMA_FINISH_ANY, &status, &g_alloc);
+    err = Lzma2Dec_DecodeToDic(dec, out_size, src, srcLen, LZMA_FINISH_ANY, &status);
+    *destLen = dec->decoder.dicPos;
+    dec->decoder.dic = nullptr;
+    if (err == SZ_OK && status == LZMA_STATUS_NEEDS_MORE_INPUT) {
+        err = SZ_ERROR_INPUT_EOF;
+    }
+    return err;
 }
 
-size_t bcj_decode(unsigned char *data, size_t size)
+int bcj2_decode(unsigned char *dest, size_t destLen,
+                const unsigned char *const *src, const size_t *srcLen)
 {
-    uint32_t state;
-    x86_Convert_Init(state);
-    return x86_Convert(data, size, 0, &state, 0);
+    CBcj2Dec dec;
+    for (unsigned i = 0; i < BCJ2_NUM_STREAMS; i++) {
+        dec.bufs[i] = src[i];
+        dec.lims[i] = src[i] + srcLen[i];
+    }
+    dec.dest = dest;
+    dec.destLim = dest + destLen;
+    Bcj2Dec_Init(&dec);
+
+    // all input is there, the decoder only stops early when a stream runs dry
+    while (dec.dest != dec.destLim) {
+        Byte *before = dec.dest;
+        int err = Bcj2Dec_Decode(&dec);
+        if (err) {
+            return err;
+        }
+        if (dec.dest == before && dec.state < BCJ2_NUM_STREAMS) {
+            return SZ_ERROR_DATA;
+        }
+    }
+    return SZ_OK;
 }
 
 };
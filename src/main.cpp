@@ -1,6 +1,9 @@
 #include "fmt/core.h"
 
 #include "7z.h"
+#include "method.h"
+#include "parallel.h"
+#include "uring.h"
 
 using namespace std;
 using arc7z = I7Zip::Archive;
@@ -24,27 +27,78 @@ std::vector<std::string> split(std::string &&s, std::string &&delimiter)
 int main(int argc, char** argv)
 {
     if (argc < 3) {
-        fmt::print("Usage 7zstd [-tlex] archive.7z\n"
+        fmt::print("Usage 7zstd [-tlexib] [-mmt[=N]] [-mmem=N] [-mio=uring] [-slp] [-p<password>] archive.7z\n"
                    "  -t            Test archive integrity\n"
+                   "  -tq           Quick test: only check the CRCs of the packed streams\n"
                    "  -l            List archive contents\n"
                    "  -g <xxx.x>    Extract files with glob match. Multiple comma-separated globs are supported.\n"
-                   "  -x            eXtract files with full paths\n");
+                   "  -x            eXtract files with full paths\n"
+                   "  -i            Build a checkpoint index for fast -g on solid archives\n"
+                   "  -b            Benchmark decoding in memory on one thread\n"
+                   "  -mmt[=N]      Decompress folders with N threads (all cores if N is omitted)\n"
+                   "  -mmem=N       Stream folders larger than N MiB through a bounded window\n"
+                   "  -mio=uring    Write extracted files with io_uring (Linux)\n"
+                   "  -mhc=off      Neither read nor write the header cache archive.7z.hdr\n"
+                   "  -slp          Take large buffers from reserved huge pages first (Linux)\n"
+                   "  -p<password>  Password of encrypted (7zAES) archives\n");
         return -1;
     }
 
+    uint32_t num_threads = 1;
+    uint64_t memory_limit = 0;
+    bool async_io = false;
+    bool header_cache = true;
+    for (int i = 2; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-mmt") == 0) {
+            num_threads = I7Zip::default_num_threads();
+        } else if (strncmp(argv[i], "-mmt=", 5) == 0) {
+            num_threads = (uint32_t)strtoul(argv[i] + 5, nullptr, 10);
+        } else if (strncmp(argv[i], "-mmem=", 6) == 0) {
+            memory_limit = strtoull(argv[i] + 6, nullptr, 10) << 20;
+        } else if (strcmp(argv[i], "-mio=uring") == 0) {
+            async_io = true;
+        } else if (strcmp(argv[i], "-mhc=off") == 0) {
+            header_cache = false;
+        } else if (strcmp(argv[i], "-slp") == 0) {
+            I7Zip::set_explicit_huge_pages(true);
+        } else if (strncmp(argv[i], "-p", 2) == 0) {
+            IMethod::set_password(argv[i] + 2);
+        }
+    }
+
     arc7z arc(argv[argc - 1]);
+    arc.set_header_cache(header_cache);
+    // testing writes nothing next to the archive
+    arc.set_header_cache_read_only(strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "-tq") == 0);
     if (!arc.read_archive()) {
         fmt::print("read_archive() failed\n");
         return -1;
     }
+    arc.set_num_threads(num_threads);
+    arc.set_memory_limit(memory_limit);
+    if (async_io && !I7Zip::uring_supported()) {
+        fmt::print("io_uring is not available, writing files synchronously\n");
+    }
+    arc.set_async_io(async_io);
 
     if (strcmp(argv[1], "-t") == 0) {
-        arc.TestArchive();
+        if (!arc.TestArchive()) {
+            return -1;
+        }
+    } else if (strcmp(argv[1], "-tq") == 0) {
+        if (!arc.QuickTest()) {
+            return -1;
+        }
     } else if (strcmp(argv[1], "-l") == 0) {
         arc.ListFiles();
     } else if (strcmp(argv[1], "-x") == 0) {
         arc.ExtractAll();
+    } else if (strcmp(argv[1], "-i") == 0) {
+        arc.BuildIndex();
+    } else if (strcmp(argv[1], "-b") == 0) {
+        arc.Benchmark();
     } else if (strcmp(argv[1], "-g") == 0) {
+        arc.load_index();
         arc.ExtractFile(split(argv[2], ","));
     } else {
         fmt::print("Unknown command {}\n", argv[1]);
@@ -0,0 +1,192 @@
+#include "mapped_file.h"
+
+#include "fmt/core.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace I7Zip {
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &name, bool optional)
+{
+    HANDLE h = CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        DWORD err = GetLastError();
+        if (!optional || err != ERROR_FILE_NOT_FOUND) {
+            fmt::print("CreateFileA() failed {}\n", err);
+        }
+        return false;
+    }
+
+    LARGE_INTEGER sz;
+    if (GetFileSizeEx(h, &sz) == FALSE) {
+        fmt::print("GetFileSizeEx() failed {}\n", GetLastError());
+        CloseHandle(h);
+        return false;
+    }
+
+    FILETIME mt;
+    if (GetFileTime(h, nullptr, nullptr, &mt)) {
+        _mtime = (((uint64_t)mt.dwHighDateTime << 32) | mt.dwLowDateTime) * 100;
+    }
+
+    _size = (uint64_t)sz.QuadPart;
+    if (_size == 0) {
+        CloseHandle(h);
+        return true;
+    }
+
+    // the view keeps the mapping and the file alive, both handles can go
+    HANDLE m = CreateFileMappingA(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(h);
+    if (m == NULL) {
+        fmt::print("CreateFileMappingA() failed {}\n", GetLastError());
+        return false;
+    }
+
+    _data = (const uint8_t *)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(m);
+    if (!_data) {
+        fmt::print("MapViewOfFile() failed {}\n", GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (_data) {
+        UnmapViewOfFile(_data);
+    }
+    _data = nullptr;
+    _size = 0;
+    _mtime = 0;
+}
+
+void MappedFile::will_need(uint64_t offset, uint64_t size) const
+{
+    if (!contains(offset, size) || size == 0) {
+        return;
+    }
+
+    WIN32_MEMORY_RANGE_ENTRY e;
+    e.VirtualAddress = (void *)(_data + offset);
+    e.NumberOfBytes = (SIZE_T)size;
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &e, 0);
+}
+
+void MappedFile::done_with(uint64_t offset, uint64_t size) const
+{
+    // the view's pages are trimmed by the system as needed
+    (void)offset;
+    (void)size;
+}
+
+#else
+
+bool MappedFile::open(const std::string &name, bool optional)
+{
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (!optional || errno != ENOENT) {
+            fmt::print("open({}) failed errno {}\n", name, errno);
+        }
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fmt::print("fstat() failed errno {}\n", errno);
+        ::close(fd);
+        return false;
+    }
+
+#ifdef __APPLE__
+    _mtime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    _mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+
+    _size = (uint64_t)st.st_size;
+    if (_size == 0) {
+        ::close(fd);
+        return true;
+    }
+
+    void *p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        fmt::print("mmap() failed errno {}\n", errno);
+        ::close(fd);
+        _size = 0;
+        return false;
+    }
+
+    _data = (const uint8_t *)p;
+    _fd = fd;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (_data) {
+        munmap((void *)_data, _size);
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+    _fd = -1;
+    _data = nullptr;
+    _size = 0;
+    _mtime = 0;
+}
+
+void MappedFile::will_need(uint64_t offset, uint64_t size) const
+{
+    if (!contains(offset, size) || size == 0) {
+        return;
+    }
+
+    // madvise() wants a page aligned start address
+    static const uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page_size - 1);
+    void *p = (void *)(_data + start);
+    size_t len = (size_t)(offset + size - start);
+
+    madvise(p, len, MADV_SEQUENTIAL);
+    madvise(p, len, MADV_WILLNEED);
+}
+
+void MappedFile::done_with(uint64_t offset, uint64_t size) const
+{
+    if (!contains(offset, size) || size == 0) {
+        return;
+    }
+
+    // only whole pages inside the range, the ones at its ends may be shared
+    // with a neighbour still being read
+    static const uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = (offset + page_size - 1) & ~(page_size - 1);
+    uint64_t end = (offset + size) & ~(page_size - 1);
+    if (start >= end) {
+        return;
+    }
+
+    // the mapping is never written, dropping its pages loses nothing
+    madvise((void *)(_data + start), (size_t)(end - start), MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(_fd, (off_t)start, (off_t)(end - start), POSIX_FADV_DONTNEED);
+#endif
+}
+
+#endif
+
+};
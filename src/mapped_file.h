@@ -0,0 +1,65 @@
+#pragma once
+
+#include "stdc++.h"
+
+namespace I7Zip {
+
+// Read-only view of a whole file. Packed streams are decoded straight from
+// the mapping, so nothing is copied into intermediate input buffers.
+class MappedFile {
+public:
+    MappedFile() : _data(nullptr), _size(0), _mtime(0), _fd(-1) {}
+    MappedFile(const MappedFile &p) = delete;
+    MappedFile & operator=(const MappedFile &p) = delete;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    // a missing file fails without a message when optional is set
+    bool open(const std::string &name, bool optional = false);
+    void close();
+
+    // hint that [offset, offset + size) is about to be read once from front to back
+    void will_need(uint64_t offset, uint64_t size) const;
+
+    // hint that [offset, offset + size) won't be read again, its pages may
+    // leave memory and the page cache
+    void done_with(uint64_t offset, uint64_t size) const;
+
+    const uint8_t *data() const
+    {
+        return _data;
+    }
+
+    uint64_t size() const
+    {
+        return _size;
+    }
+
+    // last modification time in nanoseconds, as of open()
+    uint64_t mtime() const
+    {
+        return _mtime;
+    }
+
+    bool contains(uint64_t offset, uint64_t size) const
+    {
+        return offset <= _size && size <= _size - offset;
+    }
+
+    // the file stays open for copies within the kernel, -1 on Windows
+    int fd() const
+    {
+        return _fd;
+    }
+
+private:
+    const uint8_t *_data;
+    uint64_t _size;
+    uint64_t _mtime;
+    int _fd;
+};
+
+};
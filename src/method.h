@@ -3,20 +3,222 @@
 #include "stdc++.h"
 
 namespace IMethod {
+    // Receives decoded data of a streaming decoder chunk by chunk, in order.
+    // Returning false stops the decoder.
+    typedef std::function<bool(const unsigned char *data, size_t size)> Sink;
+
+    // Output of the streaming decoders is produced in chunks of at most
+    // STREAM_STEP bytes
+    constexpr size_t STREAM_STEP = (size_t)1 << 18;
+
+    // Input still being written by another thread: waits until more than
+    // pos bytes of it are there, or the writer is done, and returns how many
+    // are.
+    typedef std::function<size_t(size_t pos)> Source;
+
+    // Decoders driven by a sink stop once destLen bytes are produced, so
+    // destLen may cover only the head of the stream.
+
+    // Decoder contexts outlive the calls using them. A decoding thread takes
+    // one from the pool, or a new one when none is left, and puts it back
+    // when done; the threads of parallel_for come and go but the contexts
+    // stay, so only the first folders pay for setting decoders up.
+    template <typename T>
+    class ContextPool {
+    public:
+        ContextPool() {}
+        ContextPool(const ContextPool &p) = delete;
+        ContextPool & operator=(const ContextPool &p) = delete;
+
+        ~ContextPool()
+        {
+            for (auto p : _free) {
+                delete p;
+            }
+        }
+
+        T *acquire()
+        {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                if (!_free.empty()) {
+                    T *p = _free.back();
+                    _free.pop_back();
+                    return p;
+                }
+            }
+            return new T();
+        }
+
+        void release(T *p)
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _free.push_back(p);
+        }
+
+    private:
+        std::mutex _lock;
+        std::vector<T *> _free;
+    };
+
+    // a context held from a pool for the lifetime of this object
+    template <typename T>
+    class PooledContext {
+    public:
+        explicit PooledContext(ContextPool<T> &pool) : _pool(pool), _ctx(pool.acquire()) {}
+        PooledContext(const PooledContext &p) = delete;
+        PooledContext & operator=(const PooledContext &p) = delete;
+
+        ~PooledContext()
+        {
+            _pool.release(_ctx);
+        }
+
+        T *operator->() const
+        {
+            return _ctx;
+        }
+
+    private:
+        ContextPool<T> &_pool;
+        T *_ctx;
+    };
+
     // ZSTD
     int zstd_decompress(void *dest, size_t destLen,
                         const void *src, size_t srcLen);
 
+    int zstd_decompress(void *dest, size_t destLen,
+                        const void *src, size_t srcLen,
+                        const Sink &sink);
+
+    // decodes the frames of a multi-frame stream on up to numThreads threads
+    // straight into their place in dest, the sink receives them in order
+    int zstd_decompress_mt(void *dest, size_t destLen,
+                           const void *src, size_t srcLen,
+                           uint32_t numThreads, const Sink &sink);
+
+    int zstd_decompress_stream(size_t destLen, const void *src, size_t srcLen,
+                               const Sink &sink);
+
     // LZMA
     int lzma_decompress(unsigned char *dest, size_t *destLen,
                         const unsigned char *src, size_t *srcLen,
                         const unsigned char *props, size_t propsSize);
 
+    // decodes into dest like above and passes every chunk to sink as soon
+    // as it has been decoded, reading src as far as source allows if given
+    int lzma_decompress(unsigned char *dest, size_t destLen,
+                        const unsigned char *src, size_t srcLen,
+                        const unsigned char *props, size_t propsSize,
+                        const Sink &sink, const Source &source = nullptr);
+
+    // decodes destLen bytes through a circular window of windowSize bytes,
+    // the window is grown to the dictionary size if that is larger
+    int lzma_decompress_stream(size_t destLen, size_t windowSize,
+                               const unsigned char *src, size_t srcLen,
+                               const unsigned char *props, size_t propsSize,
+                               const Sink &sink);
+
     // LZMA2
     int lzma2_decompress(unsigned char *dest, size_t *destLen,
                          const unsigned char *src, size_t *srcLen,
                          unsigned char prop);
 
+    int lzma2_decompress(unsigned char *dest, size_t destLen,
+                         const unsigned char *src, size_t srcLen,
+                         unsigned char prop, const Sink &sink);
+
+    // Streams from multithreaded encoders reset the dictionary every few
+    // MiB. Those blocks are decoded on up to numThreads threads straight into
+    // their place in dest, the sink still receives the output in order.
+    int lzma2_decompress_mt(unsigned char *dest, size_t destLen,
+                            const unsigned char *src, size_t srcLen,
+                            unsigned char prop, uint32_t numThreads,
+                            const Sink &sink);
+
+    int lzma2_decompress_stream(size_t destLen, size_t windowSize,
+                                const unsigned char *src, size_t srcLen,
+                                unsigned char prop, const Sink &sink);
+
+    // Decoder state at some point of an LZMA or LZMA2 stream, enough to
+    // decode on from there without any of the data before it
+    struct Checkpoint {
+        size_t packed_offset;           // input position to resume at
+        size_t unpack_offset;           // output position it resumes at
+        const unsigned char *state;     // saved decoder, nullptr at an LZMA2 dictionary reset
+        size_t state_size;
+        const unsigned char *history;   // the dictionary right before unpack_offset
+        size_t history_size;
+    };
+
+    typedef std::function<bool(const Checkpoint &cp)> CheckpointSink;
+
+    // changes whenever saved decoder states of this build can't be loaded
+    uint32_t checkpoint_layout();
+
+    // Decode the whole stream once and pass a checkpoint to save about every
+    // interval bytes of output (0 picks an interval from the dictionary size).
+    // LZMA2 dictionary resets are used as checkpoints as they are.
+    int lzma_checkpoints(size_t destLen, const unsigned char *src, size_t srcLen,
+                         const unsigned char *props, size_t propsSize,
+                         size_t interval, const CheckpointSink &save);
+
+    int lzma2_checkpoints(size_t destLen, const unsigned char *src, size_t srcLen,
+                          unsigned char prop, size_t interval, const CheckpointSink &save);
+
+    // decode destLen bytes of the stream starting at cp.unpack_offset into dest
+    int lzma_resume(const Checkpoint &cp, unsigned char *dest, size_t destLen,
+                    const unsigned char *src, size_t srcLen,
+                    const unsigned char *props, size_t propsSize, const Sink &sink);
+
+    int lzma2_resume(const Checkpoint &cp, unsigned char *dest, size_t destLen,
+                     const unsigned char *src, size_t srcLen,
+                     unsigned char prop, const Sink &sink);
+
+    // 7zAES
+    // The password for encrypted folders and headers, in UTF-8. Keys derived
+    // from it are cached by salt and number of rounds.
+    void set_password(const std::string &password);
+    bool has_password();
+
+    // AES-256-CBC with the key derived from the password and props, srcLen
+    // is destLen padded to whole blocks. Chunks are decrypted on up to
+    // numThreads threads and handed to sink in order.
+    int aes_decode(unsigned char *dest, size_t destLen,
+                   const unsigned char *src, size_t srcLen,
+                   const unsigned char *props, size_t propsSize,
+                   uint32_t numThreads, const Sink &sink);
+
+    // BCJ2, src and srcLen are the main, call, jump and range coder streams
+    int bcj2_decode(unsigned char *dest, size_t destLen,
+                    const unsigned char *const *src, const size_t *srcLen);
+
+    // Branch converters of the BCJ family, in the order of their method IDs
+    enum BranchFilter {
+        BRANCH_X86,
+        BRANCH_PPC,
+        BRANCH_IA64,
+        BRANCH_ARM,
+        BRANCH_ARMT,
+        BRANCH_SPARC,
+        BRANCH_ARM64,
+    };
+
+    // Like bcj_decode() below for any of the filters, state is only used by
+    // x86. No filter holds back more than 15 bytes for the next piece.
+    size_t branch_decode(BranchFilter filter, unsigned char *data, size_t size, uint32_t ip, uint32_t *state);
+
+    // Delta of distance dist (1 to 256) in place. history holds the last
+    // dist decoded bytes before data, zeros at the start of a stream, and
+    // is updated for the next piece.
+    void delta_decode(unsigned char *data, size_t size, unsigned dist, unsigned char *history);
+
     // BCJ
     size_t bcj_decode(unsigned char *data, size_t size);
+
+    // converts a piece of a stream starting at stream position ip, returns
+    // how many leading bytes are final; the rest must be passed again
+    // together with the following data
+    size_t bcj_decode(unsigned char *data, size_t size, uint32_t ip, uint32_t *state);
 };
@@ -0,0 +1,351 @@
+#include "output.h"
+
+#include "fmt/core.h"
+#include "fmt/xchar.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace I7Zip {
+
+// set in the attribute by p7zip and 7-Zip for Linux, the high 16 bits then
+// hold st_mode of the archived file
+constexpr static uint32_t FILE_ATTRIBUTE_UNIX_EXTENSION = 0x8000;
+
+uint32_t file_mode(const FileInfo &info)
+{
+    if (info.has_attribute() && (info.attribute() & FILE_ATTRIBUTE_UNIX_EXTENSION)) {
+        uint32_t mode = (info.attribute() >> 16) & 07777;
+        if (mode) {
+            return mode;
+        }
+    }
+    return info.is_directory() ? 0755 : 0644;
+}
+
+std::string utf16_to_utf8(const uint16_t *in)
+{
+    std::string out;
+    utf16_to_utf8(in, out);
+    return out;
+}
+
+void utf16_to_utf8(const uint16_t *in, std::string &out)
+{
+    out.clear();
+    utf16_to_utf8_append(in, out);
+    out.pop_back();
+}
+
+#ifdef _WIN32
+
+void utf16_to_utf8_append(const uint16_t *in, std::string &out)
+{
+    size_t pos = out.size();
+    int size = WideCharToMultiByte(CP_UTF8, 0, (const wchar_t *)in, -1, NULL, 0, NULL, NULL);
+    out.resize(pos + size);
+    WideCharToMultiByte(CP_UTF8, 0, (const wchar_t *)in, -1, &out[pos], size, NULL, NULL);
+}
+
+NativeName native_name(const FileInfo &info)
+{
+    return NativeName((const wchar_t *)info.name());
+}
+
+void print_extracted(const FileInfo &info)
+{
+    fmt::print(L"- {}\n", (const wchar_t *)info.name());
+}
+
+bool ensure_dir_exists(const NativeName &name)
+{
+    const wchar_t *p = name.c_str();
+    wchar_t tmp[MAX_PATH];
+    uint32_t i = 0;
+
+    while (*p != L'\0') {
+        if (*p != L'/') {
+            tmp[i++] = *p;
+        } else {
+            tmp[i] = L'\0';
+            if (CreateDirectoryW(tmp, nullptr) == FALSE) {
+                DWORD err = GetLastError();
+                if (err != ERROR_ALREADY_EXISTS) {
+                    fmt::print("CreateDirectoryW() failed {}\n", err);
+                    return false;
+                }
+            }
+            tmp[i++] = L'/';
+        }
+        ++p;
+    }
+
+    return true;
+}
+
+bool process_empty_stream(const FileInfo &info)
+{
+    NativeName name = native_name(info);
+
+    if (info.is_directory()) {
+        if (CreateDirectoryW(name.c_str(), nullptr) == FALSE) {
+            fmt::print("CreateDirectoryW() failed {}\n", GetLastError());
+            return false;
+        }
+    } else {
+        if (!ensure_dir_exists(name)) {
+            fmt::print("ensure_dir_exists() failed\n");
+            return false;
+        }
+        HANDLE h = CreateFileW(name.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, info.attribute(), NULL);
+        if (h == INVALID_HANDLE_VALUE) {
+            fmt::print("CreateFileW() failed {}\n", GetLastError());
+            return false;
+        }
+        CloseHandle(h);
+    }
+
+    return true;
+}
+
+bool filetime_to_local(uint64_t filetime, LocalTime &t)
+{
+    ULARGE_INTEGER ui;
+    ui.QuadPart = filetime;
+    FILETIME ft{ui.u.LowPart, ui.u.HighPart}, local_ft;
+    SYSTEMTIME st;
+    if (FileTimeToLocalFileTime(&ft, &local_ft) == FALSE) {
+        fmt::print("Failed to convert FILETIME to local FILETIME\n");
+        return false;
+    }
+    if (FileTimeToSystemTime(&local_ft, &st) == FALSE) {
+        fmt::print("Failed to convert FILETIME {} to SYSTEMTIME\n", filetime);
+        return false;
+    }
+    t = LocalTime{st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond};
+    return true;
+}
+
+OutputFile::OutputFile() : _h(INVALID_HANDLE_VALUE) {}
+
+bool OutputFile::open(const FileInfo &info)
+{
+    NativeName name = native_name(info);
+    if (!ensure_dir_exists(name)) {
+        fmt::print("ensure_dir_exists() failed\n");
+        return false;
+    }
+    _h = CreateFileW(name.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, info.attribute(), NULL);
+    if (_h == INVALID_HANDLE_VALUE) {
+        fmt::print("CreateFileW() failed {}\n", GetLastError());
+        return false;
+    }
+    return true;
+}
+
+bool OutputFile::write(const uint8_t *buffer, size_t size)
+{
+    while (size) {
+        DWORD curr = 0;
+        DWORD n = size < 0x40000000 ? (DWORD)size : 0x40000000;
+        if (WriteFile(_h, buffer, n, &curr, nullptr) == FALSE) {
+            fmt::print("WirteFile() failed {}\n", GetLastError());
+            return false;
+        }
+        buffer += curr;
+        size -= curr;
+    }
+    return true;
+}
+
+bool OutputFile::write_from(const MappedFile &file, uint64_t offset, size_t size)
+{
+    return write(file.data() + offset, size);
+}
+
+void OutputFile::close()
+{
+    if (_h != INVALID_HANDLE_VALUE) {
+        CloseHandle(_h);
+        _h = INVALID_HANDLE_VALUE;
+    }
+}
+
+#else
+
+void utf16_to_utf8_append(const uint16_t *in, std::string &out)
+{
+    for (; *in; in++) {
+        uint32_t c = *in;
+        if (c >= 0xd800 && c < 0xdc00 && in[1] >= 0xdc00 && in[1] < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (in[1] - 0xdc00);
+            in++;
+        } else if (c >= 0xd800 && c < 0xe000) {
+            c = 0xfffd; // unpaired surrogate
+        }
+
+        if (c < 0x80) {
+            out.push_back((char)c);
+        } else if (c < 0x800) {
+            out.push_back((char)(0xc0 | (c >> 6)));
+            out.push_back((char)(0x80 | (c & 0x3f)));
+        } else if (c < 0x10000) {
+            out.push_back((char)(0xe0 | (c >> 12)));
+            out.push_back((char)(0x80 | ((c >> 6) & 0x3f)));
+            out.push_back((char)(0x80 | (c & 0x3f)));
+        } else {
+            out.push_back((char)(0xf0 | (c >> 18)));
+            out.push_back((char)(0x80 | ((c >> 12) & 0x3f)));
+            out.push_back((char)(0x80 | ((c >> 6) & 0x3f)));
+            out.push_back((char)(0x80 | (c & 0x3f)));
+        }
+    }
+    out.push_back('\0');
+}
+
+NativeName native_name(const FileInfo &info)
+{
+    return NativeName(info.utf8_name(), info.utf8_size());
+}
+
+void print_extracted(const FileInfo &info)
+{
+    fmt::print("- {}\n", native_name(info));
+}
+
+bool ensure_dir_exists(const NativeName &name)
+{
+    // files of a folder are mostly stored directory by directory, remember
+    // the last directory this thread created so its siblings skip mkdir()
+    static thread_local std::string last_dir;
+
+    size_t end = name.rfind('/');
+    if (end == std::string::npos || end == 0) {
+        return true;
+    }
+    if (last_dir.size() == end && name.compare(0, end, last_dir) == 0) {
+        return true;
+    }
+
+    std::string tmp;
+    for (size_t pos = name.find('/', 1); pos != std::string::npos && pos <= end; pos = name.find('/', pos + 1)) {
+        tmp.assign(name, 0, pos);
+        if (mkdir(tmp.c_str(), 0755) != 0 && errno != EEXIST) {
+            fmt::print("mkdir({}) failed errno {}\n", tmp, errno);
+            return false;
+        }
+    }
+
+    last_dir.assign(name, 0, end);
+    return true;
+}
+
+bool process_empty_stream(const FileInfo &info)
+{
+    NativeName name = native_name(info);
+
+    if (info.is_directory()) {
+        if (!ensure_dir_exists(name)) {
+            fmt::print("ensure_dir_exists() failed\n");
+            return false;
+        }
+        if (mkdir(name.c_str(), file_mode(info)) != 0 && errno != EEXIST) {
+            fmt::print("mkdir({}) failed errno {}\n", name, errno);
+            return false;
+        }
+    } else {
+        OutputFile f;
+        return f.open(info);
+    }
+
+    return true;
+}
+
+bool filetime_to_local(uint64_t filetime, LocalTime &t)
+{
+    // FILETIME counts 100ns intervals since 1601-01-01
+    time_t unix_time = (time_t)(filetime / 10000000) - 11644473600LL;
+    struct tm tm;
+    if (!localtime_r(&unix_time, &tm)) {
+        fmt::print("Failed to convert FILETIME {} to local time\n", filetime);
+        return false;
+    }
+    t = LocalTime{(uint32_t)tm.tm_year + 1900, (uint32_t)tm.tm_mon + 1, (uint32_t)tm.tm_mday,
+                  (uint32_t)tm.tm_hour, (uint32_t)tm.tm_min, (uint32_t)tm.tm_sec};
+    return true;
+}
+
+OutputFile::OutputFile() : _fd(-1) {}
+
+bool OutputFile::open(const FileInfo &info)
+{
+    NativeName name = native_name(info);
+    if (!ensure_dir_exists(name)) {
+        fmt::print("ensure_dir_exists() failed\n");
+        return false;
+    }
+    _fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, file_mode(info));
+    if (_fd < 0) {
+        fmt::print("open({}) failed errno {}\n", name, errno);
+        return false;
+    }
+    return true;
+}
+
+bool OutputFile::write(const uint8_t *buffer, size_t size)
+{
+    while (size) {
+        size_t n = size < 0x40000000 ? size : 0x40000000;
+        ssize_t curr = ::write(_fd, buffer, n);
+        if (curr < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fmt::print("write() failed errno {}\n", errno);
+            return false;
+        }
+        buffer += curr;
+        size -= curr;
+    }
+    return true;
+}
+
+bool OutputFile::write_from(const MappedFile &file, uint64_t offset, size_t size)
+{
+#ifdef __linux__
+    // the page cache pages of the archive go to the file without a trip
+    // through user space, file systems sharing extents may even reflink
+    loff_t in_offset = (loff_t)offset;
+    while (size) {
+        ssize_t curr = copy_file_range(file.fd(), &in_offset, _fd, nullptr, size, 0);
+        if (curr > 0) {
+            size -= curr;
+            continue;
+        }
+        if (curr < 0 && errno == EINTR) {
+            continue;
+        }
+        // not supported for this pair of files, or a short read
+        break;
+    }
+    offset = (uint64_t)in_offset;
+#endif
+    return write(file.data() + offset, size);
+}
+
+void OutputFile::close()
+{
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+#endif
+
+};
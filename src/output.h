@@ -0,0 +1,72 @@
+#pragma once
+
+#include "7z.h"
+
+namespace I7Zip {
+
+std::string utf16_to_utf8(const uint16_t *in);
+
+// converts into out, reusing its storage
+void utf16_to_utf8(const uint16_t *in, std::string &out);
+
+// appends the conversion of in to out, with a terminating NUL
+void utf16_to_utf8_append(const uint16_t *in, std::string &out);
+
+// name of the file as passed to the file system of this platform
+#ifdef _WIN32
+typedef std::wstring NativeName;
+#else
+typedef std::string NativeName;
+#endif
+
+NativeName native_name(const FileInfo &info);
+
+// prints "- name" for an extracted file
+void print_extracted(const FileInfo &info);
+
+// creates all parent directories of name
+bool ensure_dir_exists(const NativeName &name);
+
+bool process_empty_stream(const FileInfo &info);
+
+struct LocalTime {
+    uint32_t year;
+    uint32_t month;
+    uint32_t day;
+    uint32_t hour;
+    uint32_t minute;
+    uint32_t second;
+};
+
+bool filetime_to_local(uint64_t filetime, LocalTime &t);
+
+class OutputFile {
+public:
+    OutputFile();
+    OutputFile(const OutputFile &p) = delete;
+    OutputFile & operator=(const OutputFile &p) = delete;
+
+    ~OutputFile()
+    {
+        close();
+    }
+
+    bool open(const FileInfo &info);
+    bool write(const uint8_t *buffer, size_t size);
+    // size bytes of file from offset on, copied within the kernel where the
+    // platform and the file systems allow it
+    bool write_from(const MappedFile &file, uint64_t offset, size_t size);
+    void close();
+
+private:
+#ifdef _WIN32
+    void *_h;
+#else
+    int _fd;
+#endif
+};
+
+// permission bits of a file extracted on a POSIX system
+uint32_t file_mode(const FileInfo &info);
+
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "stdc++.h"
+
+namespace I7Zip {
+
+inline uint32_t default_num_threads()
+{
+    uint32_t n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Run task(0) ... task(n - 1) on up to num_threads threads, the calling thread
+// included. Indexes are handed out in increasing order; once a task returns
+// false no new index is started and false is returned.
+inline bool parallel_for(uint32_t n, uint32_t num_threads, const std::function<bool(uint32_t)> &task)
+{
+    std::atomic<uint32_t> next(0);
+    std::atomic<bool> success(true);
+
+    auto worker = [&]() {
+        while (success.load(std::memory_order_relaxed)) {
+            uint32_t i = next.fetch_add(1);
+            if (i >= n) {
+                break;
+            }
+            if (!task(i)) {
+                success = false;
+            }
+        }
+    };
+
+    if (num_threads > n) {
+        num_threads = n;
+    }
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    return success;
+}
+
+// Like parallel_for, but done(i) is also called for every i in increasing
+// order, as soon as task(i) and all tasks before it have finished. Calls of
+// done() never overlap, so it may feed an in-order consumer.
+inline bool parallel_for_ordered(uint32_t n, uint32_t num_threads,
+                                 const std::function<bool(uint32_t)> &task,
+                                 const std::function<bool(uint32_t)> &done)
+{
+    std::mutex lock;
+    std::vector<bool> finished(n, false);
+    uint32_t next = 0;
+
+    return parallel_for(n, num_threads, [&](uint32_t i) {
+        if (!task(i)) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        finished[i] = true;
+        for (; next < n && finished[next]; next++) {
+            if (!done(next)) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+};
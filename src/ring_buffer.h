@@ -0,0 +1,112 @@
+#pragma once
+
+#include "stdc++.h"
+
+namespace I7Zip {
+
+// Bounded byte queue between two threads of a coder pipeline, one writing
+// and one reading. The bytes are copied outside the lock, only the positions
+// are shared. Small enough to stay in cache while both sides work on it.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity)
+        : _buf(new uint8_t[capacity]), _capacity(capacity), _head(0), _tail(0), _closed(false), _aborted(false) {}
+    RingBuffer(const RingBuffer &r) = delete;
+    RingBuffer & operator=(const RingBuffer &r) = delete;
+
+    ~RingBuffer()
+    {
+        delete[] _buf;
+    }
+
+    // blocks while the ring is full, false once the pipeline was aborted
+    bool write(const uint8_t *data, size_t size)
+    {
+        while (size) {
+            uint64_t head;
+            size_t n;
+            {
+                std::unique_lock<std::mutex> guard(_lock);
+                _not_full.wait(guard, [this] {
+                    return _aborted || _head - _tail < _capacity;
+                });
+                if (_aborted) {
+                    return false;
+                }
+                head = _head;
+                n = _capacity - (size_t)(_head - _tail);
+            }
+
+            size_t pos = (size_t)(head % _capacity);
+            n = std::min(std::min(n, size), _capacity - pos);
+            ::memcpy(_buf + pos, data, n);
+            data += n;
+            size -= n;
+
+            std::lock_guard<std::mutex> guard(_lock);
+            _head += n;
+            _not_empty.notify_one();
+        }
+        return true;
+    }
+
+    // the writer is done, the reader gets the rest and then the end
+    void close()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _closed = true;
+        _not_empty.notify_one();
+    }
+
+    // wakes up both sides for good, after a stage of the pipeline failed
+    void abort()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _aborted = true;
+        _not_empty.notify_one();
+        _not_full.notify_one();
+    }
+
+    // Waits for data and points data at the contiguous part of it. Returns
+    // its size, 0 at the end of the stream or when aborted.
+    size_t read(const uint8_t *&data)
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _not_empty.wait(guard, [this] {
+            return _aborted || _closed || _head != _tail;
+        });
+        if (_aborted || _head == _tail) {
+            return 0;
+        }
+        size_t pos = (size_t)(_tail % _capacity);
+        data = _buf + pos;
+        return std::min((size_t)(_head - _tail), _capacity - pos);
+    }
+
+    // frees the first size bytes returned by read()
+    void consume(size_t size)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _tail += size;
+        _not_full.notify_one();
+    }
+
+    bool aborted()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _aborted;
+    }
+
+private:
+    uint8_t *_buf;
+    size_t _capacity;
+    uint64_t _head; // bytes written so far
+    uint64_t _tail; // bytes read so far
+    bool _closed;
+    bool _aborted;
+    std::mutex _lock;
+    std::condition_variable _not_full;
+    std::condition_variable _not_empty;
+};
+
+};
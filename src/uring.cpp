@@ -0,0 +1,327 @@
+#include "uring.h"
+#include "output.h"
+
+#include "fmt/core.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+// direct descriptors for open and close came with the same kernels
+#ifdef IORING_FEAT_CQE_SKIP
+#define URING_SUPPORTED
+#endif
+#endif
+
+namespace I7Zip {
+
+// sync fallback for systems without io_uring
+static bool write_files(const std::vector<FileInfo> &files, const uint8_t *out)
+{
+    for (auto info : files) {
+        OutputFile f;
+        if (!f.open(info) || !f.write(out + info.offset(), info.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef URING_SUPPORTED
+
+constexpr static uint32_t RING_ENTRIES = 256;
+// files are opened into a table registered with the ring, not into the fd
+// table of the process, one slot per file in flight
+constexpr static uint32_t FILE_SLOTS = 64;
+constexpr static uint64_t MAX_WRITE = 0x40000000;
+constexpr static uint64_t FALLOCATE_MIN = 1 << 20;
+
+// Minimal io_uring instance driven by raw syscalls. All queued entries are
+// submitted and completed by run() before new ones are queued.
+class Ring {
+public:
+    Ring() : _fd(-1), _sq_ptr(MAP_FAILED), _cq_ptr(MAP_FAILED), _sqes(nullptr), _sq_len(0), _cq_len(0),
+             _sqes_len(0), _tail(0), _queued(0) {}
+    Ring(const Ring &p) = delete;
+    Ring & operator=(const Ring &p) = delete;
+
+    ~Ring()
+    {
+        if (_sqes) {
+            munmap(_sqes, _sqes_len);
+        }
+        if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr) {
+            munmap(_cq_ptr, _cq_len);
+        }
+        if (_sq_ptr != MAP_FAILED) {
+            munmap(_sq_ptr, _sq_len);
+        }
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    bool init(uint32_t entries, uint32_t num_files)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        _fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (_fd < 0 || !(p.features & IORING_FEAT_CQE_SKIP)) {
+            return false;
+        }
+
+        _sq_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        _cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+            _sq_len = _cq_len = std::max(_sq_len, _cq_len);
+        }
+
+        _sq_ptr = mmap(nullptr, _sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if (_sq_ptr == MAP_FAILED) {
+            return false;
+        }
+        _cq_ptr = single ? _sq_ptr : mmap(nullptr, _cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        if (_cq_ptr == MAP_FAILED) {
+            return false;
+        }
+        _sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, _sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        _sqes = (io_uring_sqe *)sqes;
+
+        uint8_t *sq = (uint8_t *)_sq_ptr;
+        _sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+        _sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+        _sq_array = (uint32_t *)(sq + p.sq_off.array);
+        _sq_entries = p.sq_entries;
+        _tail = *_sq_tail;
+
+        uint8_t *cq = (uint8_t *)_cq_ptr;
+        _cq_head = (uint32_t *)(cq + p.cq_off.head);
+        _cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+        _cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+        _cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        // sparse table, the slots are filled by the open requests
+        std::vector<int32_t> fds(num_files, -1);
+        return syscall(__NR_io_uring_register, _fd, IORING_REGISTER_FILES, fds.data(), num_files) == 0;
+    }
+
+    uint32_t space() const
+    {
+        return _sq_entries - _queued;
+    }
+
+    io_uring_sqe *get_sqe(uint64_t user_data)
+    {
+        uint32_t i = _tail & _sq_mask;
+        _sq_array[i] = i;
+        io_uring_sqe *sqe = &_sqes[i];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = user_data;
+        _tail++;
+        _queued++;
+        return sqe;
+    }
+
+    // submits everything queued and calls complete(user_data, res) for every
+    // completion, returns after the last one has arrived
+    template <typename F>
+    bool run(F complete)
+    {
+        uint32_t to_submit = _queued;
+        uint32_t pending = _queued;
+        _queued = 0;
+        __atomic_store_n(_sq_tail, _tail, __ATOMIC_RELEASE);
+
+        bool success = true;
+        while (pending) {
+            long ret = syscall(__NR_io_uring_enter, _fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fmt::print("io_uring_enter() failed errno {}\n", errno);
+                return false;
+            }
+            to_submit -= (uint32_t)ret;
+
+            uint32_t head = *_cq_head;
+            uint32_t tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++, pending--) {
+                io_uring_cqe *cqe = &_cqes[head & _cq_mask];
+                if (!complete(cqe->user_data, cqe->res)) {
+                    success = false;
+                }
+            }
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        }
+        return success;
+    }
+
+private:
+    int _fd;
+    void *_sq_ptr;
+    void *_cq_ptr;
+    io_uring_sqe *_sqes;
+    size_t _sq_len;
+    size_t _cq_len;
+    size_t _sqes_len;
+
+    uint32_t *_sq_tail;
+    uint32_t *_sq_array;
+    uint32_t _sq_mask;
+    uint32_t _sq_entries;
+    uint32_t _tail;
+    uint32_t _queued;
+
+    uint32_t *_cq_head;
+    uint32_t *_cq_tail;
+    uint32_t _cq_mask;
+    io_uring_cqe *_cqes;
+};
+
+// every extraction worker owns a ring, set up on first use
+static Ring *thread_ring()
+{
+    static thread_local Ring ring;
+    static thread_local int state = 0;
+    if (state == 0) {
+        state = ring.init(RING_ENTRIES, FILE_SLOTS) ? 1 : -1;
+    }
+    return state > 0 ? &ring : nullptr;
+}
+
+bool uring_supported()
+{
+    return thread_ring() != nullptr;
+}
+
+struct RingOp {
+    const char *name;
+    uint32_t file;
+    int32_t expected;
+};
+
+bool uring_write_files(const std::vector<FileInfo> &files, const uint8_t *out)
+{
+    Ring *ring = thread_ring();
+    if (!ring) {
+        return write_files(files, out);
+    }
+
+    // the kernel reads the names while the requests are in flight
+    std::vector<std::string> names(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        names[i] = native_name(files[i]);
+        if (!ensure_dir_exists(names[i])) {
+            fmt::print("ensure_dir_exists() failed\n");
+            return false;
+        }
+    }
+
+    std::vector<RingOp> ops;
+    uint32_t next = 0;
+    while (next < files.size()) {
+        ops.clear();
+        uint32_t slot = 0;
+        while (next < files.size() && slot < FILE_SLOTS) {
+            const FileInfo &info = files[next];
+            uint64_t num_writes = (info.size() + MAX_WRITE - 1) / MAX_WRITE;
+            uint64_t chain = 2 + num_writes + (info.size() >= FALLOCATE_MIN);
+            if (chain > ring->space()) {
+                if (slot) {
+                    break;
+                }
+                // larger than a whole ring can describe
+                if (!write_files({info}, out)) {
+                    return false;
+                }
+                next++;
+                continue;
+            }
+
+            io_uring_sqe *sqe = ring->get_sqe(ops.size());
+            ops.push_back(RingOp{"openat", next, 0});
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)names[next].c_str();
+            sqe->len = file_mode(info);
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC; // no O_CLOEXEC for direct descriptors
+            sqe->file_index = slot + 1;
+            sqe->flags = IOSQE_IO_LINK;
+
+            // reserve the extents up front, the writes below may be executed
+            // by several kernel workers
+            if (info.size() >= FALLOCATE_MIN) {
+                sqe = ring->get_sqe(ops.size());
+                ops.push_back(RingOp{"fallocate", next, 0});
+                sqe->opcode = IORING_OP_FALLOCATE;
+                sqe->fd = slot;
+                sqe->addr = info.size();
+                sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            }
+
+            for (uint64_t off = 0; off < info.size(); off += MAX_WRITE) {
+                uint32_t n = (uint32_t)std::min(MAX_WRITE, info.size() - off);
+                sqe = ring->get_sqe(ops.size());
+                ops.push_back(RingOp{"write", next, (int32_t)n});
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = slot;
+                sqe->addr = (uint64_t)(uintptr_t)(out + info.offset() + off);
+                sqe->len = n;
+                sqe->off = off;
+                sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            }
+
+            // the slot is released even when a request before it failed
+            sqe->flags = (sqe->flags & ~IOSQE_IO_LINK) | IOSQE_IO_HARDLINK;
+
+            sqe = ring->get_sqe(ops.size());
+            ops.push_back(RingOp{"close", next, 0});
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = slot + 1;
+
+            next++;
+            slot++;
+        }
+
+        bool success = ring->run([&](uint64_t id, int32_t res) {
+            auto &op = ops[id];
+            if (res == op.expected) {
+                return true;
+            }
+            // a request before it in the same chain failed and reported already
+            if (res != -ECANCELED) {
+                fmt::print("io_uring {}({}) failed {}\n", op.name, names[op.file], res);
+            }
+            return false;
+        });
+        if (!success) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#else
+
+bool uring_supported()
+{
+    return false;
+}
+
+bool uring_write_files(const std::vector<FileInfo> &files, const uint8_t *out)
+{
+    return write_files(files, out);
+}
+
+#endif
+
+};
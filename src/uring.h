@@ -0,0 +1,17 @@
+#pragma once
+
+#include "7z.h"
+
+namespace I7Zip {
+
+// true when this thread could set up an io_uring instance (Linux 5.15+)
+bool uring_supported();
+
+// Writes files[i] from out + files[i].offset(). Open, preallocation, writes
+// and close of every file are queued as one linked chain and the chains of
+// many files are submitted with a single syscall, so the worker does not
+// block on each file in turn. Data is written straight from out, which must
+// stay alive until this returns.
+bool uring_write_files(const std::vector<FileInfo> &files, const uint8_t *out);
+
+};
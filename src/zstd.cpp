@@ -2,17 +2,178 @@
 #define ZSTD_STATIC_LINKING_ONLY
 
 #include "method.h"
+#include "parallel.h"
 
 #include "zstd.h"
 #include "zstd_errors.h"
 
 namespace IMethod {
 
+// One DCtx serves both the single call and the streaming API, its window
+// buffers are kept between uses
+struct ZstdContext {
+    ZSTD_DCtx *dctx;
+
+    ZstdContext() : dctx(ZSTD_createDCtx()) {}
+
+    ~ZstdContext()
+    {
+        ZSTD_freeDCtx(dctx);
+    }
+};
+
+static ContextPool<ZstdContext> zstd_contexts;
+
 int zstd_decompress(void *dest, size_t destLen,
                     const void *src, size_t srcLen)
 {
-    size_t err = ZSTD_decompress(dest, destLen, src, srcLen);
+    PooledContext<ZstdContext> ctx(zstd_contexts);
+    if (!ctx->dctx) {
+        return ZSTD_error_memory_allocation;
+    }
+    size_t err = ZSTD_decompressDCtx(ctx->dctx, dest, destLen, src, srcLen);
     return ZSTD_getErrorCode(err);
 }
 
+// Decode destLen bytes in steps of at most STREAM_STEP. Output goes to dest
+// when given, otherwise every step reuses buf.
+static int zstd_decode(unsigned char *dest, unsigned char *buf, size_t destLen,
+                       const void *src, size_t srcLen, const Sink &sink)
+{
+    PooledContext<ZstdContext> ctx(zstd_contexts);
+    ZSTD_DCtx *ds = ctx->dctx;
+    if (!ds) {
+        return ZSTD_error_memory_allocation;
+    }
+    // drop whatever an earlier stream left behind, on error as well
+    ZSTD_DCtx_reset(ds, ZSTD_reset_session_only);
+    // ZSTD_decompress() accepts any window size, keep the streaming path on par
+    ZSTD_DCtx_setParameter(ds, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX);
+
+    ZSTD_inBuffer in = {src, srcLen, 0};
+    size_t out_total = 0;
+    int err = 0;
+
+    while (out_total < destLen) {
+        size_t limit = destLen - out_total;
+        unsigned char *p = dest ? dest + out_total : buf;
+        ZSTD_outBuffer out = {p, limit < STREAM_STEP ? limit : STREAM_STEP, 0};
+        size_t ret = ZSTD_decompressStream(ds, &out, &in);
+        if (ZSTD_isError(ret)) {
+            err = ZSTD_getErrorCode(ret);
+            break;
+        }
+        if (out.pos && !sink(p, out.pos)) {
+            err = ZSTD_error_GENERIC;
+            break;
+        }
+        if (out.pos == 0 && in.pos == in.size) {
+            err = ZSTD_error_srcSize_wrong;
+            break;
+        }
+        out_total += out.pos;
+    }
+    return err;
+}
+
+int zstd_decompress(void *dest, size_t destLen,
+                    const void *src, size_t srcLen,
+                    const Sink &sink)
+{
+    return zstd_decode((unsigned char *)dest, nullptr, destLen, src, srcLen, sink);
+}
+
+struct ZstdFrame {
+    size_t packed_offset;
+    size_t packed_size;
+    size_t unpack_offset;
+    size_t unpack_size;
+    bool partial;   // only the head of the frame is wanted
+};
+
+// Every zstd frame is independent; find them all from their headers. Fails
+// when a frame does not record its content size. Frames after the one
+// holding byte destLen - 1 are left out.
+static bool zstd_split(const unsigned char *src, size_t srcLen, size_t destLen,
+                       std::vector<ZstdFrame> &frames)
+{
+    size_t pos = 0;
+    size_t unpacked = 0;
+
+    while (pos < srcLen && unpacked < destLen) {
+        size_t packed = ZSTD_findFrameCompressedSize(src + pos, srcLen - pos);
+        if (ZSTD_isError(packed)) {
+            return false;
+        }
+        unsigned long long unpack = ZSTD_getFrameContentSize(src + pos, packed);
+        if (unpack == ZSTD_CONTENTSIZE_UNKNOWN || unpack == ZSTD_CONTENTSIZE_ERROR) {
+            return false;
+        }
+
+        bool partial = unpack > destLen - unpacked;
+        size_t size = partial ? destLen - unpacked : (size_t)unpack;
+        frames.push_back({pos, packed, unpacked, size, partial});
+        pos += packed;
+        unpacked += size;
+    }
+
+    return unpacked == destLen;
+}
+
+int zstd_decompress_mt(void *dest, size_t destLen,
+                       const void *src, size_t srcLen,
+                       uint32_t numThreads, const Sink &sink)
+{
+    unsigned char *out = (unsigned char *)dest;
+    const unsigned char *in = (const unsigned char *)src;
+    std::vector<ZstdFrame> frames;
+    if (numThreads < 2 || !zstd_split(in, srcLen, destLen, frames) || frames.size() < 2) {
+        return zstd_decompress(dest, destLen, src, srcLen, sink);
+    }
+
+    std::atomic<int> error(0);
+    Sink none = [](const unsigned char *, size_t) {
+        return true;
+    };
+
+    I7Zip::parallel_for_ordered(frames.size(), numThreads, [&](uint32_t i) {
+        auto &f = frames[i];
+        if (f.partial) {
+            int err = zstd_decode(out + f.unpack_offset, nullptr, f.unpack_size, in + f.packed_offset, f.packed_size, none);
+            if (err) {
+                error = err;
+            }
+            return err == 0;
+        }
+
+        PooledContext<ZstdContext> ctx(zstd_contexts);
+        if (!ctx->dctx) {
+            error = ZSTD_error_memory_allocation;
+            return false;
+        }
+        size_t ret = ZSTD_decompressDCtx(ctx->dctx, out + f.unpack_offset, f.unpack_size,
+                                         in + f.packed_offset, f.packed_size);
+        if (ZSTD_isError(ret) || ret != f.unpack_size) {
+            error = ZSTD_isError(ret) ? ZSTD_getErrorCode(ret) : ZSTD_error_corruption_detected;
+            return false;
+        }
+        return true;
+    }, [&](uint32_t i) {
+        if (!sink(out + frames[i].unpack_offset, frames[i].unpack_size)) {
+            error = ZSTD_error_GENERIC;
+            return false;
+        }
+        return true;
+    });
+
+    return error;
+}
+
+int zstd_decompress_stream(size_t destLen, const void *src, size_t srcLen,
+                           const Sink &sink)
+{
+    std::vector<unsigned char> buf(destLen < STREAM_STEP ? destLen : STREAM_STEP);
+    return zstd_decode(nullptr, buf.data(), destLen, src, srcLen, sink);
+}
+
 };